@@ -4,6 +4,13 @@
 #define LED_PIN 7
 #define NUM_LEDS 88
 
+// Bytes the host may have in flight. Stays below the 64 byte RX buffer.
+#define RX_CREDITS 48
+
+// The host asks for the free space until it first hears from us, the answer has the top bit set.
+#define FLOW_REQUEST 0x7F
+#define FLOW_FREE 0x80
+
 
 typedef unsigned char uchar;
 
@@ -11,23 +18,37 @@ CRGB leds[NUM_LEDS];
 uchar color[3] = { 56, 128, 244 };
 
 
-uchar readByte() {
-	while (Serial.available() <= 0);
-	return Serial.read();
-}
-
 void setup() {
     Serial.begin(9600);
     FastLED.addLeds<WS2812B, LED_PIN, GRB>(leds, NUM_LEDS);
 }
 
 void loop() {
-	uchar instruction = readByte();
-	uchar event = instruction >> 7;
-	int index = (instruction & 0x7F);
+	uchar consumed = 0;
+
+	// Apply everything already received before paying for a show().
+	while (Serial.available() > 0 && consumed < RX_CREDITS) {
+		uchar instruction = Serial.read();
+
+		// Not a note, and the host sends nothing against credits before the answer.
+		if (instruction == FLOW_REQUEST) {
+			Serial.write((uchar) (FLOW_FREE | RX_CREDITS));
+			continue;
+		}
 
-	if (index >= 0 && index < NUM_LEDS) {
-		leds[index] = CRGB(color[0] * event, color[1] * event, color[2] * event);
+		uchar event = instruction >> 7;
+		int index = (instruction & 0x7F);
+
+		if (index >= 0 && index < NUM_LEDS)
+			leds[index] = CRGB(color[0] * event, color[1] * event, color[2] * event);
+
+		++consumed;
+	}
+
+	if (consumed) {
 		FastLED.show();
+
+		// Interrupts are back on, hand the consumed bytes back as credits.
+		Serial.write(consumed);
 	}
 }
\ No newline at end of file
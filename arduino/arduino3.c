@@ -0,0 +1,62 @@
+#include <FastLED.h>
+
+
+#define LED_PIN 7
+#define NUM_LEDS 88
+
+// Frame layout: sync, run count, then per run start, count, red, green, blue.
+#define FRAME_SYNC 0xFF
+
+// Largest frame the host may send before the next grant.
+#define FRAME_CREDITS 48
+
+// The host asks for the free space until it first hears from us, the answer has the top bit set.
+#define FLOW_REQUEST 0x7F
+#define FLOW_FREE 0x80
+
+
+typedef unsigned char uchar;
+
+CRGB leds[NUM_LEDS];
+
+
+uchar readByte() {
+	while (Serial.available() <= 0);
+	return Serial.read();
+}
+
+void setup() {
+	Serial.begin(9600);
+	FastLED.addLeds<WS2812B, LED_PIN, GRB>(leds, NUM_LEDS);
+}
+
+void loop() {
+	uchar byte = readByte();
+
+	// Requests only arrive between frames, where the host owes us a sync.
+	if (byte == FLOW_REQUEST) {
+		Serial.write((uchar) (FLOW_FREE | FRAME_CREDITS));
+		return;
+	}
+
+	// Resynchronise on the frame marker.
+	if (byte != FRAME_SYNC)
+		return;
+
+	uchar runs = readByte();
+
+	for (uchar i = 0; i < runs; ++i) {
+		int start = readByte();
+		int count = readByte();
+		uchar red = readByte();
+		uchar green = readByte();
+		uchar blue = readByte();
+
+		for (int index = start; index < start + count && index < NUM_LEDS; ++index)
+			leds[index] = CRGB(red, green, blue);
+	}
+
+	// The host spent its credits on this frame, nothing arrives during show().
+	FastLED.show();
+	Serial.write((uchar) FRAME_CREDITS);
+}
@@ -0,0 +1,216 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "midi_writer.h"
+
+
+// Events in flight to the writer, a power of two.
+#define CAPTURE_QUEUE 4096
+// Half a milli second per tick, at 120 BPM.
+#define CAPTURE_TICKS_PER_QUARTER 1000
+#define CAPTURE_TEMPO 500000
+
+
+struct capture_event
+{
+	// Micro seconds since the capture started.
+	uint64_t time;
+	uint8_t status, size;
+	uint8_t data[2];
+};
+
+
+/**
+Recording of live MIDI input into a Standard MIDI File.
+
+The input thread timestamps each message on arrival and hands it over
+through a single producer, single consumer ring: a copy, a release
+store and a fence, never a lock. A writer thread drains the ring
+into a `midi_writer` and sleeps on a futex once it is empty, so an idle
+capture costs nothing; the input thread only makes a system call for
+the first event after such a sleep. If the writer falls a whole ring
+behind, new events are dropped and counted rather than stalling the
+input.
+*/
+struct capture
+{
+	struct capture_event events[CAPTURE_QUEUE];
+
+	// Written by the input thread, on its own cache line.
+	_Alignas(64) _Atomic size_t tail;
+	uint64_t dropped;
+
+	// Written by the writer thread.
+	_Alignas(64) _Atomic size_t head;
+	_Atomic uint8_t closing;
+	uint8_t failed;
+	// Futex set while the writer sleeps, cleared by whoever wakes it.
+	_Atomic uint32_t sleeping;
+
+	pthread_t thread;
+	struct midi_writer writer[1];
+	uint64_t start;
+
+	// Live input decoder, used by the input thread only.
+	uint8_t running_status, got;
+	uint8_t data[2];
+};
+
+
+/// Data bytes following `status`.
+static inline uint8_t capture_message_size(uint8_t status)
+{
+	switch (status & 0xF0) {
+	case EventProgramChange:
+	case EventChannelPressure:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+/// Wake the writer if it sleeps, after publishing `tail` or `closing`.
+static inline void capture_wake(struct capture *self)
+{
+	// Pairs with the fence in capture_write: either it sees the store, or this sees it asleep.
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&self->sleeping, memory_order_relaxed)
+		&& atomic_exchange_explicit(&self->sleeping, 0, memory_order_relaxed))
+		syscall(SYS_futex, &self->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void *capture_write(void *argument)
+{
+	struct capture *self = (struct capture *) argument;
+	struct capture_event *event;
+	size_t head, tail;
+	uint8_t closing;
+
+	for (;;) {
+		closing = atomic_load_explicit(&self->closing, memory_order_acquire);
+		head = atomic_load_explicit(&self->head, memory_order_relaxed);
+		tail = atomic_load_explicit(&self->tail, memory_order_acquire);
+
+		for (; head != tail; ++head) {
+			event = self->events + head % CAPTURE_QUEUE;
+			if (!self->failed && midi_writer_event(self->writer, event->time, event->status, event->data, event->size))
+				self->failed = 1;
+
+			atomic_store_explicit(&self->head, head + 1, memory_order_release);
+		}
+
+		// Everything pushed before closing was set is written.
+		if (closing)
+			return NULL;
+
+		// Sleep unless something came in since the ring was drained.
+		atomic_store_explicit(&self->sleeping, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (atomic_load_explicit(&self->tail, memory_order_relaxed) == head
+			&& !atomic_load_explicit(&self->closing, memory_order_relaxed))
+			syscall(SYS_futex, &self->sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+
+		atomic_store_explicit(&self->sleeping, 0, memory_order_relaxed);
+	}
+}
+
+/**
+Start recording into `path`, with time 0 at `start` on the link clock.
+Return `self`, or NULL on error.
+*/
+static struct capture *capture_new(struct capture *self, const char *path, uint64_t start)
+{
+	memset(self, 0, sizeof(struct capture));
+	self->start = start;
+
+	if (!midi_writer_new(self->writer, path, CAPTURE_TICKS_PER_QUARTER, CAPTURE_TEMPO))
+		return NULL;
+
+	if (pthread_create(&self->thread, NULL, capture_write, self) != 0) {
+		printf("Error starting the capture writer\n");
+		midi_writer_close(self->writer);
+		return NULL;
+	}
+
+	return self;
+}
+
+/**
+Feed one byte of live input received at `clock`.
+Return 1 and fill `event` when it completes a channel message.
+*/
+static inline uint8_t capture_input(struct capture *self, uint8_t byte, uint64_t clock, struct capture_event *event)
+{
+	// Real time messages may come between any two bytes.
+	if (byte >= 0xF8)
+		return 0;
+
+	// System messages cancel running status and are not recorded.
+	if (byte & 0x80) {
+		self->running_status = byte < 0xF0 ? byte : 0;
+		self->got = 0;
+		return 0;
+	}
+
+	if (!self->running_status)
+		return 0;
+
+	self->data[self->got++] = byte;
+	if (self->got < capture_message_size(self->running_status))
+		return 0;
+
+	event->time = clock > self->start ? clock - self->start : 0;
+	event->status = self->running_status;
+	event->size = self->got;
+	memcpy(event->data, self->data, sizeof(event->data));
+
+	self->got = 0;
+	return 1;
+}
+
+/// Hand `event` to the writer. Only called from the input thread.
+static inline void capture_push(struct capture *self, const struct capture_event *event)
+{
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_relaxed);
+
+	if (tail - atomic_load_explicit(&self->head, memory_order_acquire) == CAPTURE_QUEUE) {
+		++self->dropped;
+		return;
+	}
+
+	self->events[tail % CAPTURE_QUEUE] = *event;
+	atomic_store_explicit(&self->tail, tail + 1, memory_order_release);
+	capture_wake(self);
+}
+
+/// Write out what is queued, finish the file and join the writer.
+static int capture_close(struct capture *self)
+{
+	atomic_store_explicit(&self->closing, 1, memory_order_release);
+	capture_wake(self);
+	pthread_join(self->thread, NULL);
+
+	return midi_writer_close(self->writer) || self->failed ? -1 : 0;
+}
+
+static void capture_stats_show(struct capture *self, FILE *output)
+{
+	fprintf(output, "capture: %llu events, %llu dropped, %llu bytes in %llu writes\n",
+		(unsigned long long) self->writer->events, (unsigned long long) self->dropped,
+		(unsigned long long) self->writer->written, (unsigned long long) self->writer->flushes);
+}
+
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,283 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define COLOR_FRAME_RATE 30
+
+#define COLOR_PIXELS 88
+#define COLOR_FIRST_NOTE 21
+
+// Frames over which a released key fades out.
+#define COLOR_DECAY_STEPS 32
+
+#define COLOR_FRAME_SYNC 0xFF
+#define COLOR_HEADER_SIZE 2
+#define COLOR_RUN_SIZE 5
+
+// Largest frame the device accepts, its per frame credit grant.
+#define COLOR_FRAME_SIZE_MAX 48
+
+// A run whose colour moves by more than this is sent before the others.
+#define COLOR_MAJOR_CHANGE 96
+
+// Brightest preview of a key about to be played.
+#define COLOR_ANTICIPATION 48
+
+
+struct color_pixel
+{
+	uint8_t hue, level, decay, held;
+
+	// Preview of the next note, set afresh every frame.
+	uint8_t anticipation, anticipation_hue;
+};
+
+
+/**
+Host side colour engine.
+
+Key colours come from lookup tables built once: velocity to brightness,
+channel to hue, hue to RGB, and the envelope applied after a note-off.
+Every frame only the pixels that differ from what the device shows are
+sent, as runs of identically coloured neighbours.
+
+Frame layout: `COLOR_FRAME_SYNC`, run count, then per run
+`start, count, red, green, blue`.
+*/
+struct color_engine
+{
+	uint8_t velocity_level[128];
+	uint8_t channel_hue[16];
+	uint8_t decay_scale[COLOR_DECAY_STEPS];
+	uint8_t hue_rgb[256][3];
+
+	struct color_pixel pixels[COLOR_PIXELS];
+	uint8_t target[COLOR_PIXELS][3];
+	uint8_t shown[COLOR_PIXELS][3];
+
+	uint64_t frames, bytes, runs, deferred, encode_ns;
+	uint32_t max_bytes, max_encode_ns;
+};
+
+
+static void color_engine_new(struct color_engine *self)
+{
+	uint32_t rise, fall;
+
+	memset(self, 0, sizeof(struct color_engine));
+
+	// Quadratic response, so soft notes stay dim but visible.
+	for (uint32_t velocity = 1; velocity < 128; ++velocity)
+		self->velocity_level[velocity] = 8 + velocity * velocity * 247 / (127 * 127);
+
+	// Start from blue and spread the channels around the colour wheel.
+	for (uint32_t channel = 0; channel < 16; ++channel)
+		self->channel_hue[channel] = 160 + channel * 97;
+
+	for (uint32_t step = 0; step < COLOR_DECAY_STEPS; ++step) {
+		fall = COLOR_DECAY_STEPS - step - 1;
+		self->decay_scale[step] = fall * fall * 255 / ((COLOR_DECAY_STEPS - 1) * (COLOR_DECAY_STEPS - 1));
+	}
+
+	// Full saturation and value, six sectors of 43 hues each.
+	for (uint32_t hue = 0; hue < 256; ++hue) {
+		rise = hue % 43 * 6;
+		fall = 255 - rise;
+
+		uint8_t *rgb = self->hue_rgb[hue];
+		switch (hue / 43) {
+		case 0: rgb[0] = 255;  rgb[1] = rise; rgb[2] = 0;    break;
+		case 1: rgb[0] = fall; rgb[1] = 255;  rgb[2] = 0;    break;
+		case 2: rgb[0] = 0;    rgb[1] = 255;  rgb[2] = rise; break;
+		case 3: rgb[0] = 0;    rgb[1] = fall; rgb[2] = 255;  break;
+		case 4: rgb[0] = rise; rgb[1] = 0;    rgb[2] = 255;  break;
+		default: rgb[0] = 255; rgb[1] = 0;    rgb[2] = fall; break;
+		}
+	}
+}
+
+static void color_engine_note(struct color_engine *self, uint8_t note, uint8_t channel, uint8_t velocity, uint8_t event_on)
+{
+	struct color_pixel *pixel;
+
+	if (note < COLOR_FIRST_NOTE || note >= COLOR_FIRST_NOTE + COLOR_PIXELS)
+		return;
+
+	pixel = self->pixels + note - COLOR_FIRST_NOTE;
+
+	// A stray or repeated release must not restart the fade of a key already let go.
+	if (!event_on && !pixel->held)
+		return;
+
+	pixel->decay = 0;
+	pixel->held = event_on;
+
+	if (event_on) {
+		pixel->hue = self->channel_hue[channel & 0x0F];
+		pixel->level = self->velocity_level[velocity & 0x7F];
+	}
+}
+
+/// Light an idle key dimly in the colour of the note about to play on it.
+static inline void color_engine_anticipate(struct color_engine *self, uint8_t note, uint8_t channel, uint8_t level)
+{
+	struct color_pixel *pixel;
+
+	if (note < COLOR_FIRST_NOTE || note >= COLOR_FIRST_NOTE + COLOR_PIXELS)
+		return;
+
+	pixel = self->pixels + note - COLOR_FIRST_NOTE;
+	pixel->anticipation = level;
+	pixel->anticipation_hue = self->channel_hue[channel & 0x0F];
+}
+
+/// Advance the release envelopes by one frame and update the target colours.
+static void color_engine_tick(struct color_engine *self)
+{
+	struct color_pixel *pixel;
+	uint8_t scale, *rgb;
+
+	for (size_t i = 0; i < COLOR_PIXELS; ++i) {
+		pixel = self->pixels + i;
+		rgb = self->hue_rgb[pixel->hue];
+
+		if (pixel->held) {
+			scale = pixel->level;
+		} else if (pixel->decay < COLOR_DECAY_STEPS) {
+			scale = pixel->level * self->decay_scale[pixel->decay++] >> 8;
+		} else {
+			scale = 0;
+		}
+
+		if (!pixel->held && pixel->anticipation > scale) {
+			scale = pixel->anticipation;
+			rgb = self->hue_rgb[pixel->anticipation_hue];
+		}
+
+		pixel->anticipation = 0;
+
+		self->target[i][0] = rgb[0] * scale >> 8;
+		self->target[i][1] = rgb[1] * scale >> 8;
+		self->target[i][2] = rgb[2] * scale >> 8;
+	}
+}
+
+static inline uint32_t color_distance(const uint8_t *a, const uint8_t *b)
+{
+	return abs(a[0] - b[0]) + abs(a[1] - b[1]) + abs(a[2] - b[2]);
+}
+
+static inline uint64_t color_clock_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+Encode the pixels that changed into `frame`, within `budget` bytes.
+Large changes go first, whatever does not fit waits for the next frame.
+Return the frame size, 0 if nothing changed or nothing fits.
+*/
+static size_t color_engine_encode(struct color_engine *self, uint8_t *frame, size_t budget)
+{
+	uint64_t start = color_clock_ns();
+	uint32_t elapsed;
+	size_t size = COLOR_HEADER_SIZE, runs = 0, end;
+	uint8_t major, *color, sent[COLOR_PIXELS] = { 0 };
+
+	if (budget < COLOR_HEADER_SIZE + COLOR_RUN_SIZE)
+		return 0;
+
+	for (int pass = 0; pass < 2; ++pass) {
+		for (size_t i = 0; i < COLOR_PIXELS; i = end) {
+			end = i + 1;
+			color = self->target[i];
+
+			if (sent[i] || !memcmp(color, self->shown[i], 3))
+				continue;
+
+			major = color_distance(color, self->shown[i]) > COLOR_MAJOR_CHANGE;
+			while (end < COLOR_PIXELS
+			&& !sent[end]
+			&& !memcmp(self->target[end], color, 3)
+			&& memcmp(self->shown[end], color, 3)) {
+				major |= color_distance(color, self->shown[end]) > COLOR_MAJOR_CHANGE;
+				++end;
+			}
+
+			if (pass == 0 && !major)
+				continue;
+
+			if (size + COLOR_RUN_SIZE > budget || runs == 0xFF) {
+				// Counted once, when the second pass gives up on it.
+				self->deferred += pass;
+				continue;
+			}
+
+			frame[size++] = i;
+			frame[size++] = end - i;
+			frame[size++] = color[0];
+			frame[size++] = color[1];
+			frame[size++] = color[2];
+			++runs;
+
+			for (size_t j = i; j < end; ++j) {
+				memcpy(self->shown[j], color, 3);
+				sent[j] = 1;
+			}
+		}
+	}
+
+	if (!runs)
+		return 0;
+
+	frame[0] = COLOR_FRAME_SYNC;
+	frame[1] = runs;
+
+	elapsed = color_clock_ns() - start;
+
+	++self->frames;
+	self->bytes += size;
+	self->runs += runs;
+	self->encode_ns += elapsed;
+	self->max_bytes = size > self->max_bytes ? size : self->max_bytes;
+	self->max_encode_ns = elapsed > self->max_encode_ns ? elapsed : self->max_encode_ns;
+
+	return size;
+}
+
+/// True once every pixel shows its final colour.
+static bool color_engine_idle(struct color_engine *self)
+{
+	for (size_t i = 0; i < COLOR_PIXELS; ++i)
+		if (self->pixels[i].held || self->pixels[i].decay < COLOR_DECAY_STEPS || memcmp(self->target[i], self->shown[i], 3))
+			return false;
+
+	return true;
+}
+
+static void color_engine_stats_show(struct color_engine *self, FILE *output)
+{
+	uint64_t frames = self->frames ? self->frames : 1;
+
+	fprintf(output, "color: %llu frames, %llu runs, %llu bytes/frame (max %u), %llu deferred runs, encode %llu ns/frame (max %u)\n",
+		(unsigned long long) self->frames,
+		(unsigned long long) self->runs,
+		(unsigned long long) (self->bytes / frames),
+		self->max_bytes,
+		(unsigned long long) self->deferred,
+		(unsigned long long) (self->encode_ns / frames),
+		self->max_encode_ns);
+}
+
+
+#endif /* COLOR_H */
@@ -0,0 +1,635 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "timeline.h"
+#include "link.h"
+
+
+// Decoded files kept resident.
+#define DAEMON_CACHE 8
+#define DAEMON_QUEUE 32
+#define DAEMON_COMMAND_MAX (PATH_MAX + 16)
+#define DAEMON_REPLY_MAX 1024
+// Longest the player sleeps without looking for a command, in micro seconds.
+#define DAEMON_SLICE 2000
+// Longest a client may take to send its command, in micro seconds.
+#define DAEMON_READ_TIMEOUT 1000000
+
+
+enum
+{
+	DaemonNone,
+	DaemonPlay,
+	DaemonStop,
+	DaemonSeek,
+	DaemonQuit
+};
+
+
+struct daemon_entry
+{
+	char path[PATH_MAX];
+	struct timespec mtime;
+	off_t size;
+	struct timeline timeline[1];
+
+	// Last use, for eviction, and references from the queue and the player.
+	uint64_t used;
+	uint32_t users;
+	uint8_t loaded;
+};
+
+struct daemon_stats
+{
+	uint64_t commands, hits, misses;
+	uint64_t command_total, command_max;
+
+	// From a play, queue or seek command to its first note.
+	uint64_t starts, start_total, start_max;
+};
+
+
+/**
+Resident playback server controlled over a UNIX domain socket.
+
+A control thread accepts one command per connection, a line of text such
+as `play /path/to.mid`, and answers with a line. Files are decoded into
+timelines once and kept in a small LRU cache checked against their size
+and mtime, so replaying or queueing a known file costs a lookup. The
+player thread, which owns the serial session, blocks on a condition
+while idle and polls an atomic flag between sleeps of at most
+DAEMON_SLICE while playing, so commands cut in within milliseconds.
+*/
+struct daemon
+{
+	const char *path;
+	int fd;
+	pthread_t thread;
+	uint8_t serving;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	struct daemon_entry cache[DAEMON_CACHE];
+	uint64_t uses;
+
+	struct daemon_entry *queue[DAEMON_QUEUE];
+	size_t head, count;
+	struct daemon_entry *current;
+
+	// Set for the player by the control thread, taken under the lock.
+	_Atomic uint8_t interrupt;
+	uint64_t seek;
+	uint8_t quit;
+	// A seek that came while a play was pending, for the track it starts.
+	uint8_t seek_deferred;
+
+	// Clock of the command waiting for its first note, 0 if none.
+	uint64_t command_clock;
+	// Playback position published by the player, in micro seconds.
+	_Atomic uint64_t position;
+
+	struct daemon_stats stats;
+};
+
+
+static void daemon_entry_release(struct daemon *self, struct daemon_entry *entry)
+{
+	if (entry)
+		--entry->users;
+}
+
+/// Drop the queued tracks. Called with the lock held.
+static void daemon_queue_clear(struct daemon *self)
+{
+	for (; self->count; --self->count, ++self->head)
+		daemon_entry_release(self, self->queue[self->head % DAEMON_QUEUE]);
+}
+
+/**
+Look `path` up in the cache, decoding it on a miss.
+Return the entry with a reference taken, or NULL with `error` set.
+*/
+static struct daemon_entry *daemon_cache_get(struct daemon *self, const char *path, const char **error)
+{
+	struct daemon_entry *entry, *victim = NULL;
+	struct stat info;
+
+	if (strlen(path) >= PATH_MAX) {
+		*error = "path too long";
+		return NULL;
+	}
+
+	if (stat(path, &info) != 0) {
+		*error = strerror(errno);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+
+	for (entry = self->cache; entry < self->cache + DAEMON_CACHE; ++entry) {
+		if (entry->loaded && !strcmp(entry->path, path) && entry->size == info.st_size
+			&& entry->mtime.tv_sec == info.st_mtim.tv_sec && entry->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+			++entry->users;
+			entry->used = ++self->uses;
+			++self->stats.hits;
+			pthread_mutex_unlock(&self->lock);
+			return entry;
+		}
+
+		if (entry->users)
+			continue;
+
+		if (!victim || (victim->loaded && (!entry->loaded || entry->used < victim->used)))
+			victim = entry;
+	}
+
+	if (!victim) {
+		pthread_mutex_unlock(&self->lock);
+		*error = "every cached file is in use";
+		return NULL;
+	}
+
+	// Only this thread loads, the player never sees an entry it holds no reference to.
+	victim->users = 1;
+	victim->loaded = 0;
+	++self->stats.misses;
+	pthread_mutex_unlock(&self->lock);
+
+	timeline_free(victim->timeline);
+	if (!timeline_load(victim->timeline, path)) {
+		pthread_mutex_lock(&self->lock);
+		victim->users = 0;
+		pthread_mutex_unlock(&self->lock);
+
+		*error = "could not decode the file";
+		return NULL;
+	}
+
+	pthread_mutex_lock(&self->lock);
+	strcpy(victim->path, path);
+	victim->size = info.st_size;
+	victim->mtime = info.st_mtim;
+	victim->used = ++self->uses;
+	victim->loaded = 1;
+	pthread_mutex_unlock(&self->lock);
+
+	return victim;
+}
+
+static void daemon_stats_show(struct daemon *self, char *reply, size_t size)
+{
+	struct daemon_stats *stats = &self->stats;
+	uint64_t lookups = stats->hits + stats->misses;
+
+	snprintf(reply, size,
+		"cache: %llu hits, %llu misses (%.1f%% hit rate)\n"
+		"commands: %llu, handled in %.3f ms mean, %.3f ms max\n"
+		"first note: %llu starts, %.3f ms mean, %.3f ms max\n",
+		(unsigned long long) stats->hits, (unsigned long long) stats->misses,
+		lookups ? 100.0 * stats->hits / lookups : 0.0,
+		(unsigned long long) stats->commands,
+		stats->commands ? stats->command_total / 1000.0 / stats->commands : 0.0, stats->command_max / 1000.0,
+		(unsigned long long) stats->starts,
+		stats->starts ? stats->start_total / 1000.0 / stats->starts : 0.0, stats->start_max / 1000.0);
+}
+
+/// Run the command in `line`, received at `clock`, and write the answer to `reply`.
+static void daemon_command(struct daemon *self, char *line, uint64_t clock, char *reply, size_t size)
+{
+	struct daemon_entry *entry;
+	const char *error, *verb = line;
+	char *argument = strchr(line, ' '), *end;
+	double seconds;
+	size_t length;
+	uint8_t pending;
+
+	if (argument)
+		*argument++ = '\0';
+	else
+		argument = line + strlen(line);
+
+	if (!strcmp(verb, "play") || !strcmp(verb, "queue")) {
+		entry = daemon_cache_get(self, argument, &error);
+		if (!entry) {
+			snprintf(reply, size, "error: %s: %s\n", argument, error);
+			return;
+		}
+
+		pthread_mutex_lock(&self->lock);
+
+		if (*verb == 'p') {
+			daemon_queue_clear(self);
+			self->seek_deferred = 0;
+			if (self->current)
+				atomic_store_explicit(&self->interrupt, DaemonPlay, memory_order_relaxed);
+		}
+
+		if (self->count == DAEMON_QUEUE) {
+			daemon_entry_release(self, entry);
+			pthread_mutex_unlock(&self->lock);
+			snprintf(reply, size, "error: the queue is full\n");
+			return;
+		}
+
+		// Only time a command that starts playback.
+		if (*verb == 'p' || (!self->current && !self->count))
+			self->command_clock = clock;
+
+		self->queue[(self->head + self->count++) % DAEMON_QUEUE] = entry;
+		pthread_cond_signal(&self->wake);
+		pthread_mutex_unlock(&self->lock);
+
+		snprintf(reply, size, "ok: %s %s, %zu notes\n", *verb == 'p' ? "playing" : "queued",
+			argument, entry->timeline->count);
+	} else if (!strcmp(verb, "stop")) {
+		pthread_mutex_lock(&self->lock);
+		daemon_queue_clear(self);
+		self->seek_deferred = 0;
+		if (self->current)
+			atomic_store_explicit(&self->interrupt, DaemonStop, memory_order_relaxed);
+		pthread_mutex_unlock(&self->lock);
+
+		snprintf(reply, size, "ok: stopped\n");
+	} else if (!strcmp(verb, "seek")) {
+		seconds = strtod(argument, &end);
+		if (!*argument || *end || !(seconds >= 0 && seconds * 1000000 < UINT64_MAX)) {
+			snprintf(reply, size, "error: seek needs a time of at least 0 seconds\n");
+			return;
+		}
+
+		pthread_mutex_lock(&self->lock);
+		self->seek = (uint64_t) (seconds * 1000000);
+		pending = atomic_load_explicit(&self->interrupt, memory_order_relaxed);
+
+		if (self->current ? pending == DaemonPlay : self->count) {
+			// Not for the track playing, for the one the pending play starts.
+			self->seek_deferred = 1;
+		} else if (self->current && (pending == DaemonNone || pending == DaemonSeek)) {
+			atomic_store_explicit(&self->interrupt, DaemonSeek, memory_order_relaxed);
+		} else {
+			pthread_mutex_unlock(&self->lock);
+			snprintf(reply, size, "error: seek needs a playing track\n");
+			return;
+		}
+
+		self->command_clock = clock;
+		pthread_mutex_unlock(&self->lock);
+
+		snprintf(reply, size, "ok: seeking to %s s\n", argument);
+	} else if (!strcmp(verb, "status")) {
+		pthread_mutex_lock(&self->lock);
+		if (self->current)
+			length = snprintf(reply, size, "playing %s at %.3f s, %zu queued\n", self->current->path,
+				atomic_load_explicit(&self->position, memory_order_relaxed) / 1e6, self->count);
+		else
+			length = snprintf(reply, size, "idle, %zu queued\n", self->count);
+
+		daemon_stats_show(self, reply + MIDI_MIN(length, size), size - MIDI_MIN(length, size));
+		pthread_mutex_unlock(&self->lock);
+	} else if (!strcmp(verb, "quit")) {
+		pthread_mutex_lock(&self->lock);
+		daemon_queue_clear(self);
+		self->seek_deferred = 0;
+		self->quit = 1;
+		atomic_store_explicit(&self->interrupt, DaemonQuit, memory_order_relaxed);
+		pthread_cond_signal(&self->wake);
+		pthread_mutex_unlock(&self->lock);
+
+		snprintf(reply, size, "ok: quitting\n");
+	} else {
+		snprintf(reply, size, "error: unknown command '%s', use play, queue, stop, seek, status or quit\n", verb);
+	}
+}
+
+static void *daemon_serve(void *argument)
+{
+	struct daemon *self = (struct daemon *) argument;
+	char line[DAEMON_COMMAND_MAX], reply[DAEMON_REPLY_MAX], *newline;
+	struct timeval timeout = { .tv_sec = DAEMON_READ_TIMEOUT / 1000000, .tv_usec = DAEMON_READ_TIMEOUT % 1000000 };
+	uint64_t clock, elapsed;
+	size_t size;
+	ssize_t got;
+	int client;
+
+	while (!self->quit) {
+		client = accept(self->fd, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// The listening socket was shut down.
+			break;
+		}
+
+		// Clients are served one at a time, an idle one must not hold the others.
+		if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)
+			printf("Error %d setting the client timeout: %s\n", errno, strerror(errno));
+
+		// One line per connection.
+		for (size = 0; size < sizeof(line) - 1; size += got) {
+			got = read(client, line + size, sizeof(line) - 1 - size);
+			if (got <= 0 || memchr(line + size, '\n', got)) {
+				size += MIDI_MAX(got, 0);
+				break;
+			}
+		}
+
+		// Timed out or failed before a whole command, drop it.
+		if (got < 0) {
+			close(client);
+			continue;
+		}
+
+		clock = link_clock();
+		line[size] = '\0';
+		if ((newline = strchr(line, '\n')))
+			*newline = '\0';
+
+		daemon_command(self, line, clock, reply, sizeof(reply));
+
+		// A client gone before its answer must not raise SIGPIPE.
+		if (send(client, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+			printf("Error %d answering a client: %s\n", errno, strerror(errno));
+		close(client);
+
+		elapsed = link_clock() - clock;
+		pthread_mutex_lock(&self->lock);
+		++self->stats.commands;
+		self->stats.command_total += elapsed;
+		self->stats.command_max = MIDI_MAX(self->stats.command_max, elapsed);
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	return NULL;
+}
+
+static int daemon_socket_address(struct sockaddr_un *address, const char *path)
+{
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		printf("Error: socket path %s is too long\n", path);
+		return -1;
+	}
+
+	strcpy(address->sun_path, path);
+	return 0;
+}
+
+/**
+Remove the socket left at `path` by a daemon that did not shut down.
+Anything else there, or a socket something still listens on, is kept.
+Return 0 if `path` is free, -1 otherwise.
+*/
+static int daemon_socket_reclaim(const char *path, const struct sockaddr_un *address)
+{
+	struct stat info;
+	int fd, status;
+
+	if (lstat(path, &info) != 0)
+		return errno == ENOENT ? 0 : -1;
+
+	if (!S_ISSOCK(info.st_mode)) {
+		printf("Error: %s exists and is not a socket\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		printf("Error %d creating a socket: %s\n", errno, strerror(errno));
+		return -1;
+	}
+
+	status = connect(fd, (const struct sockaddr *) address, sizeof(struct sockaddr_un));
+	if (!status || errno != ECONNREFUSED) {
+		if (!status)
+			printf("Error: a daemon is already listening on %s\n", path);
+		else
+			printf("Error %d checking %s: %s\n", errno, path, strerror(errno));
+
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	if (unlink(path) != 0 && errno != ENOENT) {
+		printf("Error %d removing %s: %s\n", errno, path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+Listen on the socket `path` and start the control thread.
+Return `self`, or NULL on error.
+*/
+static struct daemon *daemon_new(struct daemon *self, const char *path)
+{
+	struct sockaddr_un address;
+
+	memset(self, 0, sizeof(struct daemon));
+	self->path = path;
+
+	if (daemon_socket_address(&address, path))
+		return NULL;
+
+	if (daemon_socket_reclaim(path, &address))
+		return NULL;
+
+	self->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (self->fd < 0) {
+		printf("Error %d creating a socket: %s\n", errno, strerror(errno));
+		return NULL;
+	}
+
+	if (bind(self->fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(self->fd, 8) != 0) {
+		printf("Error %d listening on %s: %s\n", errno, path, strerror(errno));
+		close(self->fd);
+		return NULL;
+	}
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->wake, NULL);
+
+	if (pthread_create(&self->thread, NULL, daemon_serve, self) != 0) {
+		printf("Error starting the control thread\n");
+		close(self->fd);
+		unlink(path);
+		return NULL;
+	}
+
+	self->serving = 1;
+	return self;
+}
+
+static void daemon_free(struct daemon *self)
+{
+	if (self->serving) {
+		shutdown(self->fd, SHUT_RDWR);
+		pthread_join(self->thread, NULL);
+		self->serving = 0;
+	}
+
+	close(self->fd);
+	unlink(self->path);
+
+	for (size_t i = 0; i < DAEMON_CACHE; ++i)
+		timeline_free(self->cache[i].timeline);
+
+	pthread_mutex_destroy(&self->lock);
+	pthread_cond_destroy(&self->wake);
+}
+
+/**
+Block until there is a track to play, releasing the one played before.
+Return it, or NULL once told to quit.
+*/
+static struct daemon_entry *daemon_next(struct daemon *self)
+{
+	struct daemon_entry *entry = NULL;
+
+	pthread_mutex_lock(&self->lock);
+	daemon_entry_release(self, self->current);
+	self->current = NULL;
+
+	while (!self->quit && !self->count)
+		pthread_cond_wait(&self->wake, &self->lock);
+
+	if (!self->quit) {
+		entry = self->queue[self->head++ % DAEMON_QUEUE];
+		--self->count;
+		self->current = entry;
+		atomic_store_explicit(&self->interrupt, self->seek_deferred ? DaemonSeek : DaemonNone, memory_order_relaxed);
+		self->seek_deferred = 0;
+		atomic_store_explicit(&self->position, 0, memory_order_relaxed);
+	}
+
+	pthread_mutex_unlock(&self->lock);
+	return entry;
+}
+
+/// The command waiting for the player, if any. Cheap enough to call between every sleep.
+static inline uint8_t daemon_interrupted(struct daemon *self)
+{
+	return atomic_load_explicit(&self->interrupt, memory_order_relaxed);
+}
+
+/// Take the command waiting for the player; for a seek, set `position`.
+static uint8_t daemon_interrupt_take(struct daemon *self, uint64_t *position)
+{
+	uint8_t command;
+
+	pthread_mutex_lock(&self->lock);
+	command = atomic_exchange_explicit(&self->interrupt, DaemonNone, memory_order_relaxed);
+	if (command == DaemonSeek)
+		*position = self->seek;
+	pthread_mutex_unlock(&self->lock);
+
+	return command;
+}
+
+/**
+The player sent its first note since a command, `lead` micro seconds into
+the track from where it started, which are rests and not latency.
+*/
+static void daemon_started(struct daemon *self, uint64_t lead)
+{
+	uint64_t latency;
+
+	pthread_mutex_lock(&self->lock);
+	if (self->command_clock) {
+		latency = link_clock() - self->command_clock;
+		latency -= MIDI_MIN(latency, lead);
+
+		++self->stats.starts;
+		self->stats.start_total += latency;
+		self->stats.start_max = MIDI_MAX(self->stats.start_max, latency);
+		self->command_clock = 0;
+	}
+	pthread_mutex_unlock(&self->lock);
+}
+
+static inline void daemon_position_set(struct daemon *self, uint64_t position)
+{
+	atomic_store_explicit(&self->position, position, memory_order_relaxed);
+}
+
+/**
+Send `argv` as one command to the daemon listening on `path` and copy
+its answer to `output`. Files to play are passed on as absolute paths.
+Return 0, or -1 on error or if the daemon answered with one.
+*/
+static int daemon_client(const char *path, int argc, char **argv, FILE *output)
+{
+	struct sockaddr_un address;
+	char line[DAEMON_COMMAND_MAX], reply[DAEMON_REPLY_MAX], absolute[PATH_MAX];
+	const char *argument;
+	size_t size = 0;
+	ssize_t got;
+	int fd, status = 0;
+
+	if (!argc) {
+		printf("Error: no command for the daemon\n");
+		return -1;
+	}
+
+	argument = argc > 1 ? argv[1] : "";
+	if ((!strcmp(argv[0], "play") || !strcmp(argv[0], "queue")) && argc > 1) {
+		if (!realpath(argv[1], absolute)) {
+			printf("Error %d resolving %s: %s\n", errno, argv[1], strerror(errno));
+			return -1;
+		}
+
+		argument = absolute;
+	}
+
+	size = snprintf(line, sizeof(line), argc > 1 ? "%s %s\n" : "%s\n", argv[0], argument);
+	if (size >= sizeof(line) || daemon_socket_address(&address, path))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+		printf("Error %d connecting to %s: %s\n", errno, path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	if (send(fd, line, size, MSG_NOSIGNAL) != (ssize_t) size) {
+		printf("Error %d sending the command: %s\n", errno, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	for (size = 0; (got = read(fd, reply, sizeof(reply))) > 0; size += got) {
+		if (!size && !strncmp(reply, "error", MIDI_MIN((size_t) got, 5)))
+			status = -1;
+
+		fwrite(reply, 1, got, output);
+	}
+
+	close(fd);
+	return status;
+}
+
+
+#endif /* DAEMON_H */
@@ -0,0 +1,194 @@
+#ifndef KEYBOARD_SHM_H
+#define KEYBOARD_SHM_H
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+#define KEYBOARD_SHM_MAGIC 0x4B425348
+#define KEYBOARD_SHM_VERSION 2
+
+
+struct keyboard_state
+{
+	// Playback time, CLOCK_MONOTONIC micro seconds. Moves on through rests too.
+	uint64_t clock;
+	uint64_t events;
+
+	uint8_t notes[128];
+	uint8_t velocity[128];
+
+	// Set with every key released once the player has exited.
+	uint8_t finished;
+};
+
+
+/**
+Live keyboard state shared with local readers.
+
+Published under a sequence lock: the writer makes `sequence` odd, updates
+the state, and makes it even again. Readers copy the state and retry if
+the sequence was odd or moved meanwhile, so they never block the writer
+and need no system call once the segment is mapped.
+
+The segment outlives the player, which marks it finished on exit. It is
+not unlinked, so a reader left running follows the next player to take
+it over.
+*/
+struct keyboard_shm
+{
+	uint32_t magic, version;
+	_Atomic uint32_t sequence;
+
+	struct keyboard_state state;
+};
+
+
+static struct keyboard_shm *keyboard_shm_map(const char *name, int flags)
+{
+	int writable = (flags & O_ACCMODE) == O_RDWR;
+	struct keyboard_shm *self;
+	int fd;
+
+	fd = shm_open(name, flags, 0644);
+	if (fd < 0) {
+		printf("Error %d opening shared memory %s: %s\n", errno, name, strerror(errno));
+		return NULL;
+	}
+
+	if (writable && ftruncate(fd, sizeof(struct keyboard_shm)) != 0) {
+		printf("Error %d sizing shared memory %s: %s\n", errno, name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	self = (struct keyboard_shm *) mmap(NULL, sizeof(struct keyboard_shm),
+		writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (self == MAP_FAILED) {
+		printf("Error %d mapping shared memory %s: %s\n", errno, name, strerror(errno));
+		return NULL;
+	}
+
+	return self;
+}
+
+/// Make the sequence odd before changing the state.
+static inline void keyboard_shm_begin(struct keyboard_shm *self)
+{
+	atomic_fetch_add_explicit(&self->sequence, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+/// Make the sequence even again, publishing the change.
+static inline void keyboard_shm_end(struct keyboard_shm *self)
+{
+	atomic_fetch_add_explicit(&self->sequence, 1, memory_order_release);
+}
+
+/// Create, or take over, the segment `name` and reset it to an idle keyboard.
+static struct keyboard_shm *keyboard_shm_create(const char *name)
+{
+	struct keyboard_shm *self = keyboard_shm_map(name, O_RDWR | O_CREAT);
+	if (!self)
+		return NULL;
+
+	keyboard_shm_begin(self);
+
+	memset(&self->state, 0, sizeof(struct keyboard_state));
+	self->magic = KEYBOARD_SHM_MAGIC;
+	self->version = KEYBOARD_SHM_VERSION;
+
+	keyboard_shm_end(self);
+	return self;
+}
+
+/// Map the segment `name` read only. Return NULL if it is missing or of another version.
+static inline struct keyboard_shm *keyboard_shm_open(const char *name)
+{
+	struct keyboard_shm *self = keyboard_shm_map(name, O_RDONLY);
+	if (!self)
+		return NULL;
+
+	if (self->magic != KEYBOARD_SHM_MAGIC || self->version != KEYBOARD_SHM_VERSION) {
+		printf("Error: %s is not a version %d keyboard segment\n", name, KEYBOARD_SHM_VERSION);
+		munmap(self, sizeof(struct keyboard_shm));
+		return NULL;
+	}
+
+	return self;
+}
+
+static inline void keyboard_shm_close(struct keyboard_shm *self)
+{
+	munmap(self, sizeof(struct keyboard_shm));
+}
+
+/// Publish a note event. Only called from the playback thread.
+static inline void keyboard_shm_note(struct keyboard_shm *self, uint8_t note, uint8_t velocity, uint8_t event_on, uint64_t clock)
+{
+	keyboard_shm_begin(self);
+
+	note &= 0x7F;
+	self->state.clock = clock;
+	self->state.notes[note] = event_on;
+	self->state.velocity[note] = event_on ? velocity : 0;
+	++self->state.events;
+
+	keyboard_shm_end(self);
+}
+
+/// Publish the playback time between events. Only called from the playback thread.
+static inline void keyboard_shm_clock(struct keyboard_shm *self, uint64_t clock)
+{
+	keyboard_shm_begin(self);
+	self->state.clock = clock;
+	keyboard_shm_end(self);
+}
+
+/// Release every key and mark the segment finished, so readers do not show a stuck keyboard.
+static inline void keyboard_shm_finish(struct keyboard_shm *self)
+{
+	keyboard_shm_begin(self);
+
+	memset(self->state.notes, 0, sizeof(self->state.notes));
+	memset(self->state.velocity, 0, sizeof(self->state.velocity));
+	self->state.finished = 1;
+	++self->state.events;
+
+	keyboard_shm_end(self);
+}
+
+/**
+Copy a consistent snapshot of the keyboard into `state`.
+Return the number of retries it took.
+*/
+static inline uint32_t keyboard_shm_read(const struct keyboard_shm *self, struct keyboard_state *state)
+{
+	struct keyboard_shm *shared = (struct keyboard_shm *) self;
+	uint32_t before, after, retries = 0;
+
+	for (;; ++retries) {
+		before = atomic_load_explicit(&shared->sequence, memory_order_acquire);
+		if (before & 1)
+			continue;
+
+		memcpy(state, (const void *) &self->state, sizeof(struct keyboard_state));
+		atomic_thread_fence(memory_order_acquire);
+
+		after = atomic_load_explicit(&shared->sequence, memory_order_relaxed);
+		if (before == after)
+			return retries;
+	}
+}
+
+
+#endif /* KEYBOARD_SHM_H */
@@ -0,0 +1,392 @@
+#ifndef LINK_H
+#define LINK_H
+
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "serial.h"
+
+
+#define LINK_QUEUE_SIZE 256
+
+// Backlog in micro seconds tolerated before note events get coalesced.
+#define LINK_LATENCY_BUDGET 50000
+
+// Bytes kept on the wire ahead of the device.
+#define LINK_WIRE_SLACK 2
+
+// Marks a queue entry removed by coalescing.
+#define LINK_NOTE_NONE 0xFF
+
+#define LINK_MIN(x, y) ((x) <= (y) ? (x) : (y))
+
+
+struct link_entry
+{
+	uint8_t note, event_on;
+};
+
+
+/**
+Model of the serial link and the note events waiting for it.
+
+The link carries `10 / baud` seconds per byte. Bytes are only handed to
+the kernel once the modelled wire has room, so the backlog lives in the
+queue where it can still be coalesced, rather than in the tty buffer.
+*/
+struct link
+{
+	struct serial_flow *flow;
+
+	uint32_t us_per_byte, latency_budget;
+
+	// Time at which everything written so far has left the wire.
+	uint64_t wire_free;
+
+	struct link_entry queue[LINK_QUEUE_SIZE];
+	uint16_t head, count, depth;
+
+	// Key state once everything written has landed, and once the whole queue has.
+	uint8_t sent[128], queued[128];
+	uint16_t pending[128];
+
+	uint64_t events, coalesced, dropped;
+	uint32_t max_backlog;
+};
+
+
+/// Monotonic clock in micro seconds.
+static inline uint64_t link_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/// Encode a note event as the single byte understood by the device.
+static inline uint8_t link_event_encode(uint8_t note, uint8_t event_on)
+{
+	note -= 21;
+	note &= 0x7F;
+
+	if (event_on)
+		note |= 0x80;
+
+	return note;
+}
+
+static void link_new(struct link *self, struct serial_flow *flow, uint32_t baud, uint32_t latency_budget)
+{
+	memset(self, 0, sizeof(struct link));
+	self->flow = flow;
+
+	// 8N1 framing puts 10 bits on the wire per byte.
+	self->us_per_byte = 10000000 / baud;
+	self->latency_budget = latency_budget;
+}
+
+/// Time, in micro seconds, before an event pushed `now` reaches the device.
+static inline uint32_t link_backlog(struct link *self, uint64_t now)
+{
+	uint32_t wire = self->wire_free > now ? self->wire_free - now : 0;
+	return wire + self->depth * self->us_per_byte;
+}
+
+static inline struct link_entry *link_entry_at(struct link *self, uint16_t index)
+{
+	return self->queue + (self->head + index) % LINK_QUEUE_SIZE;
+}
+
+/// Latest queued entry for `note`, or NULL.
+static struct link_entry *link_entry_last(struct link *self, uint8_t note)
+{
+	struct link_entry *entry;
+
+	if (!self->pending[note])
+		return NULL;
+
+	for (uint16_t i = self->count; i--;) {
+		entry = link_entry_at(self, i);
+		if (entry->note == note)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void link_entry_remove(struct link *self, struct link_entry *entry)
+{
+	struct link_entry *last;
+	uint8_t note = entry->note;
+
+	entry->note = LINK_NOTE_NONE;
+	--self->pending[note];
+	--self->depth;
+
+	last = link_entry_last(self, note);
+	self->queued[note] = last ? last->event_on : self->sent[note];
+}
+
+/// Squeeze out the entries removed by coalescing.
+static void link_compact(struct link *self)
+{
+	struct link_entry *entry;
+	uint16_t count = 0;
+
+	for (uint16_t i = 0; i < self->count; ++i) {
+		entry = link_entry_at(self, i);
+		if (entry->note != LINK_NOTE_NONE)
+			*link_entry_at(self, count++) = *entry;
+	}
+
+	self->count = count;
+}
+
+/**
+Queue a note event.
+
+Once the backlog exceeds the latency budget, events that would make no
+visible difference by the time they land are merged away: an on/off pair
+still waiting in the queue, a release and retrigger of a lit key, and any
+event restating the state the key is already going to have.
+*/
+static inline void link_push(struct link *self, uint8_t note, uint8_t event_on, uint64_t now)
+{
+	struct link_entry *last;
+
+	note &= 0x7F;
+	++self->events;
+
+	if (link_backlog(self, now) > self->latency_budget) {
+		if (self->queued[note] == event_on) {
+			++self->coalesced;
+			return;
+		}
+
+		// The latest queued event for this key is undone by this one.
+		// Drop both if that leaves the key as the device will show it anyway.
+		last = link_entry_last(self, note);
+		if (last) {
+			link_entry_remove(self, last);
+
+			if (self->queued[note] == event_on) {
+				self->coalesced += 2;
+				return;
+			}
+
+			++self->coalesced;
+		}
+	}
+
+	if (self->count == LINK_QUEUE_SIZE)
+		link_compact(self);
+
+	if (self->count == LINK_QUEUE_SIZE) {
+		// Only reachable with the budget disabled; a lost note-on is
+		// invisible, a lost note-off leaves a key lit.
+		if (event_on) {
+			++self->dropped;
+			return;
+		}
+
+		for (uint16_t i = 0; i < self->count; ++i) {
+			last = link_entry_at(self, i);
+			if (last->event_on) {
+				link_entry_remove(self, last);
+				++self->dropped;
+				break;
+			}
+		}
+
+		link_compact(self);
+		if (self->count == LINK_QUEUE_SIZE) {
+			++self->dropped;
+			return;
+		}
+	}
+
+	last = link_entry_at(self, self->count++);
+	last->note = note;
+	last->event_on = event_on;
+
+	++self->pending[note];
+	++self->depth;
+	self->queued[note] = event_on;
+}
+
+/**
+Next entry to send. Under saturation releases of lit keys jump the queue;
+the earlier events of the key they overtake are dropped, or they would
+land after the release and light the key again.
+*/
+static struct link_entry *link_entry_next(struct link *self, uint64_t now)
+{
+	struct link_entry *entry, *earlier, *first = NULL;
+
+	for (uint16_t i = 0; i < self->count; ++i) {
+		entry = link_entry_at(self, i);
+		if (entry->note == LINK_NOTE_NONE)
+			continue;
+
+		if (!first) {
+			first = entry;
+			if (link_backlog(self, now) <= self->latency_budget)
+				break;
+		}
+
+		if (!entry->event_on && self->sent[entry->note]) {
+			for (uint16_t j = 0; j < i && self->pending[entry->note] > 1; ++j) {
+				earlier = link_entry_at(self, j);
+				if (earlier->note == entry->note) {
+					link_entry_remove(self, earlier);
+					++self->coalesced;
+				}
+			}
+
+			return entry;
+		}
+	}
+
+	return first;
+}
+
+/**
+Write as many queued events as the wire model and the flow credits allow.
+Return 0 on success, or -1 on a write error.
+*/
+static int link_pump(struct link *self, uint64_t now)
+{
+	struct link_entry *entry;
+	uint8_t byte;
+	uint32_t backlog;
+
+	backlog = link_backlog(self, now);
+	if (backlog > self->max_backlog)
+		self->max_backlog = backlog;
+
+	while (self->depth
+	&& self->wire_free <= now + LINK_WIRE_SLACK * self->us_per_byte
+	&& serial_flow_poll(self->flow, 0) > 0) {
+		entry = link_entry_next(self, now);
+		byte = link_event_encode(entry->note, entry->event_on);
+
+		if (serial_flow_write(self->flow, &byte, 1))
+			return -1;
+
+		self->sent[entry->note] = entry->event_on;
+		link_entry_remove(self, entry);
+		self->wire_free = (self->wire_free > now ? self->wire_free : now) + self->us_per_byte;
+	}
+
+	// Drop the removed entries at the front.
+	while (self->count && self->queue[self->head].note == LINK_NOTE_NONE) {
+		self->head = (self->head + 1) % LINK_QUEUE_SIZE;
+		--self->count;
+	}
+
+	return 0;
+}
+
+/// Bytes that can be written `now` without queueing them behind the wire.
+static inline uint32_t link_room(struct link *self, uint64_t now)
+{
+	if (self->wire_free > now + LINK_WIRE_SLACK * self->us_per_byte)
+		return 0;
+
+	return serial_flow_poll(self->flow, 0);
+}
+
+/**
+Write a block of bytes bypassing the event queue, at most `link_room` of them.
+Return 0 on success, or -1 on a write error.
+*/
+static inline int link_write(struct link *self, const uint8_t *data, size_t size, uint64_t now)
+{
+	if (serial_flow_write(self->flow, data, size))
+		return -1;
+
+	self->wire_free = (self->wire_free > now ? self->wire_free : now) + size * self->us_per_byte;
+	return 0;
+}
+
+/**
+Keep the link busy until `deadline`.
+Return 0 on success, or -1 on a write error.
+*/
+static int link_wait(struct link *self, uint64_t deadline)
+{
+	struct pollfd pfd = { .fd = self->flow->fd, .events = POLLIN };
+	struct timespec wake_time, timeout;
+	uint64_t now, wake, ready;
+
+	for (;;) {
+		now = link_clock();
+		if (link_pump(self, now))
+			return -1;
+
+		if (now >= deadline)
+			return 0;
+
+		wake = deadline;
+
+		if (self->depth) {
+			ready = self->wire_free - LINK_MIN(self->wire_free, LINK_WIRE_SLACK * self->us_per_byte);
+
+			// The wire has room, so we are waiting on credits from the device, not past the deadline.
+			if (ready <= now) {
+				timeout.tv_sec = (deadline - now) / 1000000;
+				timeout.tv_nsec = (deadline - now) % 1000000 * 1000;
+				ppoll(&pfd, 1, &timeout, NULL);
+				continue;
+			}
+
+			wake = LINK_MIN(wake, ready);
+		}
+
+		wake_time.tv_sec = wake / 1000000;
+		wake_time.tv_nsec = wake % 1000000 * 1000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_time, NULL);
+	}
+}
+
+/**
+Wait until every queued event has left the wire.
+Return 0 on success, or -1 on a write error or if the device stops granting credits.
+*/
+static int link_drain(struct link *self)
+{
+	uint64_t progress = link_clock();
+	uint16_t depth;
+
+	while (self->depth) {
+		depth = self->depth;
+
+		if (link_wait(self, link_clock() + 10000))
+			return -1;
+
+		if (self->depth < depth) {
+			progress = link_clock();
+		} else if (link_clock() - progress > 1000 * (self->flow->granted ? SERIAL_FLOW_TIMEOUT : SERIAL_FLOW_OPEN_TIMEOUT)) {
+			printf("Error: no flow control credits from the device\n");
+			return -1;
+		}
+	}
+
+	return link_wait(self, self->wire_free);
+}
+
+static void link_stats_show(struct link *self, FILE *output)
+{
+	fprintf(output, "link: %llu events, %llu coalesced, %llu dropped, max backlog %u ms\n",
+		(unsigned long long) self->events,
+		(unsigned long long) self->coalesced,
+		(unsigned long long) self->dropped,
+		self->max_backlog / 1000);
+}
+
+
+#endif /* LINK_H */
@@ -1,3 +1,6 @@
+// sched_setaffinity and friends.
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 
@@ -5,32 +8,65 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <termios.h>
 #include <stdlib.h>
 
 #include "midi_parser.h"
+#include "midi_file.h"
+#include "midi_stream.h"
+#include "timeline.h"
+#include "raster.h"
+#include "roll.h"
 #include "serial.h"
+#include "link.h"
+#include "rt.h"
+#include "playlist.h"
+#include "keyboard_shm.h"
+#include "daemon.h"
+#include "capture.h"
 
 
 #define SERIAL_PORT
 #define SEND_SERIAL
 #define REAL_TIME
 #define SHOW_KEYBOARD
+// Send RGB frames from the colour engine instead of note events (arduino3.c).
+// Also set by `make CFLAGS="-g -Wall -DCOLOR_FRAMES"`, to run against `bin/test sim frames`.
+// #define COLOR_FRAMES
+
+#ifdef COLOR_FRAMES
+    #include "color.h"
+#endif
+
+// Rows of the piano roll above the keyboard.
+#define ROLL_ROWS 16
+
+// Steps in which the keyboard segment clock moves through rests, in micro seconds.
+#define SHM_CLOCK_STEP 10000
 
 
-void serial_midi_event_send(int fd, uint8_t note, uint8_t event_on)
+struct player
 {
-    static const int WAIT = 2;
+    FILE *output;
+    struct link *link;
+    struct keyboard_shm *shm;
 
-    note -= 21;
-    note &= 0x7F;
+    // Lookahead of the piece, NULL when not shown.
+    struct roll *roll;
+    uint64_t roll_start;
+    uint32_t roll_window;
 
-    if (event_on)
-        note |= 0x80;
+    #ifdef COLOR_FRAMES
+        struct color_engine color[1];
+        uint64_t next_frame;
+    #endif
 
-    write(fd, &note, 1);
-    usleep((useconds_t) (WAIT * 835));
-}
+    uint64_t clock;
+    uint32_t max_lateness;
+    uint8_t notes[128];
+};
 
 
 void show_keyboard(uint8_t *notes, size_t size, FILE *output)
@@ -42,57 +78,644 @@ void show_keyboard(uint8_t *notes, size_t size, FILE *output)
     putc('\n', output);
 }
 
-uint8_t midi_parse(FILE *midi, FILE *output, int fd)
+/// Draw the notes of the next `window` micro seconds falling onto the keyboard.
+void show_roll(const struct roll *roll, uint64_t time, uint32_t window, uint8_t *notes, FILE *output)
 {
-    struct midi_parser parser[1];
-	midi_parser_new(parser, midi);
+    static char grid[ROLL_ROWS][88];
+    uint32_t step = MIDI_MAX(window / ROLL_ROWS, 1);
+    const struct roll_note *note;
+    struct roll_span spans[ROLL_LAYERS];
+    size_t count, row, end;
+
+    memset(grid, ' ', sizeof(grid));
+
+    for (uint8_t key = 21; key <= 108; ++key) {
+        count = roll_range(roll, key, time, time + window, spans);
+
+        for (size_t span = 0; span < count; ++span) {
+            for (note = roll->notes + spans[span].first; note < roll->notes + spans[span].last; ++note) {
+                row = note->start > time ? (note->start - time) / step : 0;
+                end = MIDI_MIN((note->end - time - 1) / step, ROLL_ROWS - 1);
+
+                for (; row <= end; ++row)
+                    grid[row][key - 21] = '|';
+            }
+        }
+    }
+
+    for (size_t i = ROLL_ROWS; i-- > 0;) {
+        fwrite(grid[i], 1, 88, output);
+        putc('\n', output);
+    }
+
+    show_keyboard(notes, 128, output);
+}
+
+void player_new(struct player *self, FILE *output, struct link *link, struct keyboard_shm *shm)
+{
+    memset(self, 0, sizeof(struct player));
+    self->output = output;
+    self->link = link;
+    self->shm = shm;
+    self->clock = link_clock();
+
+    #ifdef COLOR_FRAMES
+        color_engine_new(self->color);
+        self->next_frame = self->clock;
+    #endif
+}
+
+void player_note(struct player *self, uint8_t note, uint8_t channel, uint8_t velocity, uint8_t event_on)
+{
+    self->notes[note] = event_on;
+
+    if (self->shm)
+        keyboard_shm_note(self->shm, note, velocity, event_on, self->clock);
+
+    #ifdef SEND_SERIAL
+        #ifdef COLOR_FRAMES
+            color_engine_note(self->color, note, channel, velocity, event_on);
+        #else
+            link_push(self->link, note, event_on, link_clock());
+        #endif
+    #endif
+}
+
+#ifdef COLOR_FRAMES
+/// Dimly light the idle keys whose next note is due within the lookahead, brighter as it nears.
+void player_anticipate(struct player *self)
+{
+    const struct roll_note *note;
+    uint64_t time = self->next_frame - self->roll_start;
+
+    for (uint8_t key = COLOR_FIRST_NOTE; key < COLOR_FIRST_NOTE + COLOR_PIXELS; ++key) {
+        note = roll_next(self->roll, key, time);
+        if (!note || note->start >= time + self->roll_window || self->notes[key])
+            continue;
 
-    uint8_t note, event_on, notes[128] = { 0 };
+        color_engine_anticipate(self->color, key, note->channel,
+            COLOR_ANTICIPATION * (time + self->roll_window - note->start) / self->roll_window);
+    }
+}
+
+int player_frame_send(struct player *self)
+{
+    uint8_t frame[COLOR_FRAME_SIZE_MAX];
+    uint64_t now = link_clock();
+    uint32_t budget = link_room(self->link, now);
+    size_t size;
+
+    // What the wire carries in one frame period.
+    budget = MIDI_MIN(budget, 1000000 / COLOR_FRAME_RATE / self->link->us_per_byte);
+    budget = MIDI_MIN(budget, COLOR_FRAME_SIZE_MAX);
+
+    if (self->roll)
+        player_anticipate(self);
+
+    color_engine_tick(self->color);
+
+    size = color_engine_encode(self->color, frame, budget);
+    if (!size)
+        return 0;
+
+    if (link_write(self->link, frame, size, now))
+        return -1;
+
+    // The device grants a new frame once this one is shown.
+    serial_flow_release(self->link->flow);
+    return 0;
+}
+#endif
+
+int player_wait(struct player *self, uint64_t deadline)
+{
+    uint64_t lateness, slice;
+
+    #ifdef COLOR_FRAMES
+        for (; self->next_frame <= deadline; self->next_frame += 1000000 / COLOR_FRAME_RATE) {
+            if (link_wait(self->link, self->next_frame) || player_frame_send(self))
+                return -1;
+
+            if (self->shm)
+                keyboard_shm_clock(self->shm, self->next_frame);
+        }
+    #endif
+
+    // Readers of the segment see the clock move while no note plays.
+    if (self->shm) {
+        for (slice = link_clock() + SHM_CLOCK_STEP; slice < deadline; slice += SHM_CLOCK_STEP) {
+            if (link_wait(self->link, slice))
+                return -1;
+
+            keyboard_shm_clock(self->shm, slice);
+        }
+    }
+
+    if (link_wait(self->link, deadline))
+        return -1;
+
+    if (self->shm)
+        keyboard_shm_clock(self->shm, deadline);
+
+    lateness = link_clock() - deadline;
+    self->max_lateness = MIDI_MAX(self->max_lateness, lateness);
+    return 0;
+}
 
+void player_show(struct player *self)
+{
+    if (self->roll)
+        show_roll(self->roll, self->clock - self->roll_start, self->roll_window, self->notes, self->output);
+    else
+        show_keyboard(self->notes, 128, self->output);
+}
+
+/// Release every held key.
+void player_silence(struct player *self)
+{
+    for (uint8_t note = 0; note < 128; ++note) {
+        if (self->notes[note])
+            player_note(self, note, 0, 0, 0);
+    }
+}
+
+/// Let the keys fade out and the link empty.
+int player_rest(struct player *self)
+{
+    #ifdef COLOR_FRAMES
+        // Let the released keys fade out.
+        for (int i = 0; i < 2 * COLOR_DECAY_STEPS && !color_engine_idle(self->color); ++i) {
+            if (player_wait(self, self->next_frame))
+                return -1;
+        }
+    #endif
+
+    return link_drain(self->link);
+}
+
+int player_finish(struct player *self)
+{
+    if (player_rest(self))
+        return -1;
+
+    #ifdef SEND_SERIAL
+        link_stats_show(self->link, stderr);
+    #endif
+    #ifdef COLOR_FRAMES
+        color_engine_stats_show(self->color, stderr);
+    #endif
+
+    return 0;
+}
+
+/// Play the events of a parser set up on `midi`, leaving the link busy with the tail.
+uint8_t midi_play(struct midi_parser *parser, FILE *midi, struct player *player)
+{
 	// for (; !parser->end_of_file; parser->timestamp += parser->dtime) {
 	for (struct midi_event event; !midi_parser_eof(parser);) {
 		midi_parser_next(parser, midi, &event);
-        event_on = 0;
 		switch (MIDI_EVENT_TYPE(&event)) {
 			case EventNoteOn:
-				event_on = event.midi_data[1] != 0;
 			case EventNoteOff:
-				note = event.midi_data[0];
-				notes[note] = event_on;
-                #ifdef SEND_SERIAL
-                    serial_midi_event_send(fd, note, event_on);
-                #endif
+				player_note(player, event.midi_data[0], MIDI_EVENT_CHANNEL(&event), event.midi_data[1],
+					MIDI_EVENT_TYPE(&event) == EventNoteOn && event.midi_data[1] != 0);
 		}
 
         #ifdef SHOW_KEYBOARD
-            show_keyboard(notes, 128, output);
+            player_show(player);
         #endif
+
+        // Every track is over, nothing follows the last event.
+        if (parser->dtime == (uint32_t) ~0)
+            break;
+
         #ifdef REAL_TIME
-            usleep((useconds_t) MIDI_DELAY(parser));
+            player->clock += MIDI_DELAY(parser);
+            if (player_wait(player, player->clock))
+                return 1;
+        #else
+            if (link_pump(player->link, link_clock()))
+                return 1;
         #endif
 	}
 
-	return 0;
+    return 0;
+}
+
+uint8_t midi_parse(FILE *midi, struct player *player)
+{
+    struct midi_parser parser[1];
+	midi_parser_new(parser, midi);
+
+    if (midi_play(parser, midi, player))
+        return 1;
+
+    return player_finish(player) ? 1 : 0;
+}
+
+/// Play a file decoded on the fly by `midi_stream`.
+uint8_t midi_stream_play(struct midi_stream *stream, struct player *player)
+{
+    struct midi_stream_note note;
+    uint64_t start = player->clock;
+
+    while (midi_stream_next(stream, &note)) {
+        // Black MIDI stacks thousands of events on one tick, draw and wait once per tick.
+        if (start + note.time > player->clock) {
+            #ifdef SHOW_KEYBOARD
+                player_show(player);
+            #endif
+            #ifdef REAL_TIME
+                player->clock = start + note.time;
+                if (player_wait(player, player->clock))
+                    return 1;
+            #else
+                player->clock = start + note.time;
+                if (link_pump(player->link, link_clock()))
+                    return 1;
+            #endif
+        }
+
+        player_note(player, note.note, note.status & 0x0F, note.velocity,
+            (note.status & 0xF0) == EventNoteOn && note.velocity != 0);
+    }
+
+    #ifdef SHOW_KEYBOARD
+        player_show(player);
+    #endif
+
+    midi_stream_stats_show(stream, stderr);
+    return player_finish(player) ? 1 : 0;
+}
+
+/// Play the tracks back to back, on one serial session and one clock.
+uint8_t playlist_play(struct playlist *playlist, struct player *player)
+{
+    struct playlist_track *track;
+
+    while ((track = playlist_next(playlist))) {
+        if (midi_play(track->parser, track->file->stream, player))
+            return 1;
+    }
+
+    return player_finish(player) ? 1 : 0;
+}
+
+/// Wait for `deadline` unless a command cuts in. Return 1 if one did, -1 on error.
+int daemon_wait(struct daemon *daemon, struct player *player, uint64_t deadline)
+{
+    uint64_t slice;
+
+    for (;;) {
+        if (daemon_interrupted(daemon))
+            return 1;
+
+        slice = MIDI_MIN(deadline, link_clock() + DAEMON_SLICE);
+        if (player_wait(player, slice))
+            return -1;
+
+        if (slice == deadline)
+            return 0;
+    }
+}
+
+/// Play a cached timeline from `position` until it ends or a command other than seek cuts in.
+uint8_t daemon_track_play(struct daemon *daemon, const struct timeline *timeline, struct player *player)
+{
+    const struct midi_stream_note *note = timeline->notes, *end = timeline->notes + timeline->count;
+    uint64_t position = 0, start = link_clock();
+    uint8_t started = 0, command;
+    int status;
+
+    player->clock = start;
+
+    while (note < end) {
+        // A command also cuts in between notes sent at once, such as the seek a track starts with.
+        if (start + note->time > player->clock || daemon_interrupted(daemon)) {
+            #ifdef SHOW_KEYBOARD
+                player_show(player);
+            #endif
+
+            status = daemon_wait(daemon, player, start + note->time);
+            if (status < 0)
+                return 1;
+
+            if (status) {
+                player_silence(player);
+                command = daemon_interrupt_take(daemon, &position);
+
+                // The next track pumps the link, no need to wait for it to empty.
+                if (command == DaemonPlay)
+                    return 0;
+                if (command != DaemonSeek)
+                    break;
+
+                // Start over from the new position.
+                note = timeline->notes + timeline_search(timeline, position);
+                start = link_clock() - position;
+                player->clock = start + position;
+                started = 0;
+                continue;
+            }
+
+            player->clock = start + note->time;
+            daemon_position_set(daemon, note->time);
+        }
+
+        if (!started) {
+            // The rest before the first note is the piece, not latency.
+            daemon_started(daemon, note->time - MIDI_MIN(note->time, position));
+            started = 1;
+        }
+
+        player_note(player, note->note, note->status & 0x0F, note->velocity, timeline_note_on(note));
+        ++note;
+    }
+
+    #ifdef SHOW_KEYBOARD
+        player_show(player);
+    #endif
+
+    return player_rest(player) ? 1 : 0;
+}
+
+/// Serve the commands of the control socket until told to quit.
+uint8_t daemon_play(struct daemon *daemon, struct player *player)
+{
+    struct daemon_entry *entry;
+
+    while ((entry = daemon_next(daemon))) {
+        if (daemon_track_play(daemon, entry->timeline, player))
+            return 1;
+    }
+
+    return player_finish(player) ? 1 : 0;
+}
+
+static volatile sig_atomic_t capture_stopped;
+
+void capture_stop(int signal)
+{
+    capture_stopped = 1;
+}
+
+/// Show live MIDI from `input` as it arrives and record it, until the input ends or SIGINT.
+uint8_t capture_play(int input, struct capture *capture, struct player *player)
+{
+    struct pollfd pfd = { .fd = input, .events = POLLIN };
+    struct timespec pump = { .tv_sec = 0, .tv_nsec = 1000000 };
+    struct capture_event event;
+    uint8_t buffer[256];
+    ssize_t got;
+    sigset_t waiting;
+
+    // SIGINT is blocked everywhere else, so it cannot land between the check and the wait.
+    sigprocmask(SIG_SETMASK, NULL, &waiting);
+    sigdelset(&waiting, SIGINT);
+
+    while (!capture_stopped) {
+        // Only wake up on a timer while the link has events to pump.
+        if (ppoll(&pfd, 1, player->link->depth ? &pump : NULL, &waiting) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            printf("Error %d waiting for input: %s\n", errno, strerror(errno));
+            return 1;
+        }
+
+        if (pfd.revents) {
+            got = read(input, buffer, sizeof(buffer));
+            player->clock = link_clock();
+            if (got <= 0)
+                break;
+
+            for (ssize_t i = 0; i < got; ++i) {
+                if (!capture_input(capture, buffer[i], player->clock, &event))
+                    continue;
+
+                // Note on or off.
+                if ((event.status & 0xE0) == EventNoteOff)
+                    player_note(player, event.data[0], event.status & 0x0F, event.data[1],
+                        (event.status & 0xF0) == EventNoteOn && event.data[1] != 0);
+
+                capture_push(capture, &event);
+            }
+
+            #ifdef SHOW_KEYBOARD
+                player_show(player);
+            #endif
+        }
+
+        if (link_pump(player->link, link_clock()))
+            return 1;
+    }
+
+    return player_finish(player) ? 1 : 0;
+}
+
+/// Rasterize a whole file at `fps` and report its polyphony.
+uint8_t raster_show(const char *path, uint32_t fps, FILE *output)
+{
+    struct timeline timeline[1];
+    struct raster raster[1];
+    struct raster_stats stats[1];
+    uint64_t start, elapsed;
+
+    if (!timeline_load(timeline, path)) {
+        printf("Error %d decoding %s\n", midi_status, path);
+        return 1;
+    }
+
+    start = link_clock();
+    if (!raster_new(raster, timeline, fps, raster_kernel_select())) {
+        timeline_free(timeline);
+        return 1;
+    }
+
+    elapsed = link_clock() - start;
+    raster_stats_compute(raster, stats);
+
+    fprintf(output, "raster: %zu notes, %zu frames at %u fps in %.3f ms (%s)\n",
+        timeline->count, raster->count, fps, elapsed / 1000.0, raster->kernel->name);
+    fprintf(output, "polyphony: max %u, mean %.2f, onsets %llu, max %u per frame\n",
+        stats->max_polyphony, stats->mean_polyphony, (unsigned long long) stats->onsets, stats->max_onsets);
+
+    raster_free(raster);
+    timeline_free(timeline);
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
     const char *portname = "/dev/ttyUSB1";
 
-    int fd = 1;
-    uint8_t return_status;
+    int fd = 1, opt, cpu = -1;
+    uint8_t return_status, real_time_priority = 0, playlist_mode = 0, stream_mode = 0;
+    size_t stream_memory = MIDI_STREAM_MEMORY;
+    uint32_t raster_fps = 0, roll_window = 0;
+    struct serial_flow flow[1];
+    struct link link[1];
+    struct player player[1];
+    struct midi_file file[1] = { 0 };
+    struct rt rt[1];
+    struct playlist playlist[1];
+    struct midi_stream stream[1];
+    struct keyboard_shm *shm = NULL;
+    struct timeline timeline[1];
+    struct roll roll[1];
+    struct daemon daemon[1];
+    const char *daemon_socket = NULL, *client_socket = NULL, *capture_input_path = NULL;
+    struct capture capture[1];
+    struct sigaction stop = { .sa_handler = capture_stop };
+    sigset_t interrupt;
+    int capture_fd = -1;
+
+    static char output_buffer[BUFSIZ];
 
     FILE
     *midi = stdin,
     *output = stderr;
 
-    switch (argc) {
-    case 3:
-        output = fopen(argv[2], "wb");
+    while ((opt = getopt(argc, argv, "rc:ls:Sm:R:P:D:C:M:d:")) != -1) {
+        switch (opt) {
+        case 'd':
+            portname = optarg;
+            break;
+        case 'l':
+            playlist_mode = 1;
+            break;
+        case 'S':
+            stream_mode = 1;
+            break;
+        case 'm':
+            stream_memory = (size_t) atoi(optarg) << 20;
+            break;
+        case 'P':
+            roll_window = atoi(optarg) * 1000000;
+            break;
+        case 'D':
+            daemon_socket = optarg;
+            break;
+        case 'C':
+            client_socket = optarg;
+            break;
+        case 'M':
+            capture_input_path = optarg;
+            break;
+        case 'R':
+            raster_fps = atoi(optarg);
+            break;
+        case 's':
+            shm = keyboard_shm_create(optarg);
+            if (!shm)
+                return -1;
+            break;
+        case 'r':
+            real_time_priority = 1;
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d port] [-r [-c cpu]] [-s shm] [-P seconds] [midi [output]]\n", argv[0]);
+            fprintf(stderr, "       %s [-r [-c cpu]] [-s shm] -l midi...\n", argv[0]);
+            fprintf(stderr, "       %s [-r [-c cpu]] [-s shm] -S [-m MiB] midi [output]\n", argv[0]);
+            fprintf(stderr, "       %s [-r [-c cpu]] [-s shm] -D socket [output]\n", argv[0]);
+            fprintf(stderr, "       %s -C socket play|queue midi | seek seconds | stop | status | quit\n", argv[0]);
+            fprintf(stderr, "       %s [-r [-c cpu]] [-s shm] -M input|- capture [output]\n", argv[0]);
+            fprintf(stderr, "       %s -R fps midi\n", argv[0]);
+            return -1;
+        }
+    }
+
+    // Offline, no device involved.
+    if (raster_fps) {
+        if (argc == optind) {
+            fprintf(stderr, "Rasterizing needs a file\n");
+            return -1;
+        }
+
+        return raster_show(argv[optind], raster_fps, stdout);
+    }
+
+    if (client_socket)
+        return daemon_client(client_socket, argc - optind, argv + optind, stdout) ? 1 : 0;
+
+    if (daemon_socket && (playlist_mode || stream_mode || roll_window)) {
+        fprintf(stderr, "The daemon takes its files over the socket\n");
+        return -1;
+    }
+
+    if (capture_input_path) {
+        if (playlist_mode || stream_mode || roll_window || daemon_socket || argc == optind) {
+            fprintf(stderr, "Capturing records live input into a single named file\n");
+            return -1;
+        }
+
+        capture_fd = strcmp(capture_input_path, "-") ? open(capture_input_path, O_RDONLY | O_NOCTTY) : 0;
+        if (capture_fd < 0) {
+            printf("Error %d opening %s: %s\n", errno, capture_input_path, strerror(errno));
+            return -1;
+        }
+
+        if (argc - optind > 1)
+            output = fopen(argv[optind + 1], "wb");
+
+        // Stop on SIGINT without restarting the poll, so the file is finished. Blocked before
+        // any thread starts, it is only taken inside the ppoll of capture_play.
+        sigaction(SIGINT, &stop, NULL);
+        sigemptyset(&interrupt);
+        sigaddset(&interrupt, SIGINT);
+        sigprocmask(SIG_BLOCK, &interrupt, NULL);
+    }
+
+    // A daemon has no file, only an optional output.
+    if (daemon_socket && argc > optind)
+        output = fopen(argv[optind], "wb");
+
+    switch (playlist_mode || daemon_socket || capture_input_path ? 0 : argc - optind) {
     case 2:
-        midi = fopen(argv[1], "rb");
+        output = fopen(argv[optind + 1], "wb");
+    case 1:
+        midi = fopen(argv[optind], "rb");
+    }
+
+    if (stream_mode) {
+        if (playlist_mode || argc == optind) {
+            fprintf(stderr, "Streaming plays a single named file\n");
+            return -1;
+        }
+
+        if (!midi_stream_open(stream, argv[optind], stream_memory)) {
+            printf("Error %d streaming %s\n", midi_status, argv[optind]);
+            return -1;
+        }
     }
 
+    // The lookahead needs the whole piece up front.
+    if (roll_window) {
+        if (playlist_mode || stream_mode || argc == optind) {
+            fprintf(stderr, "The piano roll needs a single named file\n");
+            return -1;
+        }
+
+        if (!timeline_load(timeline, argv[optind])) {
+            printf("Error %d decoding %s\n", midi_status, argv[optind]);
+            return -1;
+        }
+
+        if (!roll_new(roll, timeline)) {
+            timeline_free(timeline);
+            return -1;
+        }
+
+        timeline_free(timeline);
+    }
+
+    // Start loading the first track while the serial port opens.
+    if (playlist_mode)
+        playlist_new(playlist, argv + optind, argc - optind);
+
     #ifdef SERIAL_PORT
         fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
         if (fd < 0) {
@@ -102,11 +725,84 @@ int main(int argc, char **argv)
 
         serial_interface_set(fd, B9600, 0);
         serial_blocking_set(fd, 0);
+        serial_flow_new(flow, fd, 1);
+    #else
+        serial_flow_new(flow, fd, 0);
     #endif
 
-    return_status = midi_parse(midi, output, fd);
+    link_new(link, flow, 9600, LINK_LATENCY_BUDGET);
+
+    if (real_time_priority && !playlist_mode && !stream_mode && !daemon_socket && !capture_input_path) {
+        // The parser seeks for every event, keep the whole file in memory.
+        if (!midi_file_load(file, midi)) {
+            printf("Error loading the MIDI file into memory\n");
+            return -1;
+        }
+
+        fclose(midi);
+        midi = file->stream;
+    }
+
+    // Like the control thread below, the writer keeps the default policy.
+    if (capture_input_path && !capture_new(capture, argv[optind], link_clock()))
+        return -1;
+
+    // Before real time is enabled, so the control thread keeps the default policy and every CPU.
+    if (daemon_socket && !daemon_new(daemon, daemon_socket))
+        return -1;
+
+    if (real_time_priority) {
+        setvbuf(output, output_buffer, _IOLBF, sizeof(output_buffer));
+
+        rt_new(rt, cpu);
+        rt_enable(rt, stderr);
+    }
+
+    player_new(player, output, link, shm);
+
+    if (roll_window) {
+        player->roll = roll;
+        player->roll_start = player->clock;
+        player->roll_window = roll_window;
+    }
+
+    if (playlist_mode) {
+        return_status = playlist_play(playlist, player);
+        playlist_free(playlist);
+    } else if (capture_input_path) {
+        return_status = capture_play(capture_fd, capture, player);
+        if (capture_close(capture))
+            return_status = 1;
+
+        capture_stats_show(capture, stderr);
+        if (capture_fd)
+            close(capture_fd);
+    } else if (daemon_socket) {
+        return_status = daemon_play(daemon, player);
+        daemon_free(daemon);
+    } else if (stream_mode) {
+        return_status = midi_stream_play(stream, player);
+        midi_stream_free(stream);
+    } else {
+        return_status = midi_parse(midi, player);
+    }
+
+    if (real_time_priority)
+        rt_stats_show(rt, player->max_lateness, stderr);
+
+    if (file->stream)
+        midi_file_free(file);
+    else if (!playlist_mode && !daemon_socket && !capture_input_path)
+        fclose(midi);
+
+    if (shm) {
+        keyboard_shm_finish(shm);
+        keyboard_shm_close(shm);
+    }
+
+    if (roll_window)
+        roll_free(roll);
 
-    fclose(midi);
     fclose(output);
     return return_status;
 }
\ No newline at end of file
@@ -0,0 +1,71 @@
+#ifndef MIDI_FILE_H
+#define MIDI_FILE_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define MIDI_FILE_CHUNK (64 * 1024)
+
+
+/**
+A MIDI file read fully into memory, exposed as a stream the parser can seek
+without touching the disk.
+*/
+struct midi_file
+{
+	uint8_t *data;
+	size_t size;
+	FILE *stream;
+};
+
+
+/**
+Read the rest of `midi` into memory. `midi` may be a pipe.
+Return the in-memory stream, or NULL on error.
+*/
+static FILE *midi_file_load(struct midi_file *self, FILE *midi)
+{
+	size_t capacity = MIDI_FILE_CHUNK, read_size;
+	uint8_t *data;
+
+	memset(self, 0, sizeof(struct midi_file));
+
+	self->data = (uint8_t *) malloc(capacity);
+	if (!self->data)
+		return NULL;
+
+	while ((read_size = fread(self->data + self->size, 1, capacity - self->size, midi))) {
+		self->size += read_size;
+		if (self->size < capacity)
+			continue;
+
+		capacity *= 2;
+		data = (uint8_t *) realloc(self->data, capacity);
+		if (!data) {
+			free(self->data);
+			self->data = NULL;
+			return NULL;
+		}
+
+		self->data = data;
+	}
+
+	self->stream = fmemopen(self->data, self->size, "rb");
+	return self->stream;
+}
+
+static void midi_file_free(struct midi_file *self)
+{
+	if (self->stream)
+		fclose(self->stream);
+
+	free(self->data);
+	memset(self, 0, sizeof(struct midi_file));
+}
+
+
+#endif /* MIDI_FILE_H */
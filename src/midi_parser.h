@@ -30,7 +30,8 @@
 #define MIDI_DELAY(midi_parser) (((midi_parser)->dtime * (midi_parser)->us_per_tick))
 
 
-static uint8_t midi_status;
+// Per thread, parsers may be set up while another one plays.
+static _Thread_local uint8_t midi_status;
 
 
 enum MIDI_EventType
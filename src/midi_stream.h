@@ -0,0 +1,440 @@
+#ifndef MIDI_STREAM_H
+#define MIDI_STREAM_H
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "midi_parser.h"
+
+
+#define MIDI_STREAM_MEMORY (16 * 1024 * 1024)
+
+// Read-ahead buffer bounds per track. The lower one fits any channel event,
+// the upper one keeps a refill short enough not to stall playback.
+#define MIDI_STREAM_BUFFER_MIN 256
+#define MIDI_STREAM_BUFFER_MAX (64 * 1024)
+
+// Decoded events kept ahead of playback, in micro seconds.
+#define MIDI_STREAM_WINDOW (2 * 1000000)
+// Fewest decoded events the window holds, whatever the budget.
+#define MIDI_STREAM_WINDOW_MIN 1024
+
+// Events decoded per event consumed, so the window catches up without bursts.
+#define MIDI_STREAM_DECODE_STEP 8
+
+
+struct midi_stream_track
+{
+	// File offset of the next byte not yet buffered, and end of the chunk.
+	uint64_t offset, end;
+
+	uint8_t *buffer;
+	uint32_t position, size;
+
+	uint64_t next_tick;
+	uint8_t running_status, over;
+};
+
+/// A decoded note event, timed from the start of the file.
+struct midi_stream_note
+{
+	uint64_t time;
+	uint8_t status, note, velocity;
+};
+
+
+/**
+Streaming reader for files too big for `midi_parser`, with any number of tracks.
+
+Each track reads ahead through a small buffer refilled sequentially, and
+the tracks are merged through a min-heap on their next event tick. Note
+events are decoded into a bounded window running ahead of playback. All
+of it is sized once from the memory budget, so memory use does not
+depend on the file size. A budget too small for the minimum buffers of
+every track is refused rather than exceeded.
+*/
+struct midi_stream
+{
+	int fd;
+	uint16_t format, track_count;
+	uint32_t ticks_per_quarter;
+
+	struct midi_stream_track *tracks;
+	uint8_t *buffers;
+	uint32_t buffer_size;
+
+	// Tracks still playing, ordered on (next_tick, index).
+	uint16_t *heap;
+	uint16_t heap_size;
+
+	// Last tempo change: tick, time and micro seconds per quarter note.
+	uint64_t tempo_tick, tempo_time;
+	uint32_t tempo;
+
+	struct midi_stream_note *window;
+	uint32_t window_capacity, window_head, window_count;
+
+	size_t memory;
+	uint64_t events, refills, bytes_read;
+};
+
+
+static inline uint16_t midi_stream_read16(const uint8_t *data)
+{
+	return data[0] << 8 | data[1];
+}
+
+static inline uint32_t midi_stream_read32(const uint8_t *data)
+{
+	return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+/// Move the unread bytes to the front of the buffer and read more behind them.
+static int midi_stream_refill(struct midi_stream *self, struct midi_stream_track *track)
+{
+	uint32_t left = track->size - track->position;
+	uint64_t wanted = MIDI_MIN(self->buffer_size - left, track->end - track->offset);
+	ssize_t size;
+
+	memmove(track->buffer, track->buffer + track->position, left);
+	track->position = 0;
+	track->size = left;
+
+	if (!wanted)
+		return 0;
+
+	size = pread(self->fd, track->buffer + left, wanted, track->offset);
+	if (size <= 0)
+		return -1;
+
+	track->offset += size;
+	track->size += size;
+
+	++self->refills;
+	self->bytes_read += size;
+
+	// Ask the kernel to start reading this track's next buffer ahead of time.
+	if (track->offset < track->end)
+		posix_fadvise(self->fd, track->offset, MIDI_MIN(self->buffer_size, track->end - track->offset), POSIX_FADV_WILLNEED);
+
+	return 0;
+}
+
+/// Next byte of the track. A truncated track reads as over.
+static inline uint8_t midi_stream_getc(struct midi_stream *self, struct midi_stream_track *track)
+{
+	if (track->position == track->size && (midi_stream_refill(self, track) || track->position == track->size)) {
+		track->over = 1;
+		return 0;
+	}
+
+	return track->buffer[track->position++];
+}
+
+static void midi_stream_skip(struct midi_stream *self, struct midi_stream_track *track, uint64_t size)
+{
+	uint32_t buffered = track->size - track->position;
+
+	if (size <= buffered) {
+		track->position += size;
+		return;
+	}
+
+	// Drop the buffer and jump over the rest in the file.
+	track->position = track->size = 0;
+	track->offset = MIDI_MIN(track->offset + size - buffered, track->end);
+}
+
+static uint32_t midi_stream_value_read(struct midi_stream *self, struct midi_stream_track *track)
+{
+	uint8_t buffer = 0x80;
+	uint32_t value = 0;
+
+	for (int i = 0; i < 4 && buffer & 0x80; ++i) {
+		buffer = midi_stream_getc(self, track);
+		value = value << 7 | (buffer & 0x7F);
+	}
+
+	return value;
+}
+
+/// Time in micro seconds of `tick`, at the current tempo.
+static inline uint64_t midi_stream_time(struct midi_stream *self, uint64_t tick)
+{
+	return self->tempo_time + (tick - self->tempo_tick) * self->tempo / self->ticks_per_quarter;
+}
+
+static inline int midi_stream_before(struct midi_stream *self, uint16_t a, uint16_t b)
+{
+	uint64_t tick_a = self->tracks[a].next_tick, tick_b = self->tracks[b].next_tick;
+	return tick_a < tick_b || (tick_a == tick_b && a < b);
+}
+
+static void midi_stream_heap_down(struct midi_stream *self, uint32_t index)
+{
+	uint16_t *heap = self->heap;
+	uint32_t child;
+
+	for (; (child = 2 * index + 1) < self->heap_size; index = child) {
+		if (child + 1 < self->heap_size && midi_stream_before(self, heap[child + 1], heap[child]))
+			++child;
+
+		if (!midi_stream_before(self, heap[child], heap[index]))
+			break;
+
+		uint16_t swap = heap[child];
+		heap[child] = heap[index];
+		heap[index] = swap;
+	}
+}
+
+static void midi_stream_free(struct midi_stream *self)
+{
+	if (self->fd >= 0)
+		close(self->fd);
+
+	free(self->tracks);
+	free(self->buffers);
+	free(self->heap);
+	free(self->window);
+	memset(self, 0, sizeof(struct midi_stream));
+	self->fd = -1;
+}
+
+/**
+Open `path` for streaming within about `memory` bytes.
+Return `self`, or NULL on error with `midi_status` set.
+*/
+static struct midi_stream *midi_stream_open(struct midi_stream *self, const char *path, size_t memory)
+{
+	uint8_t header[MIDI_HEADER_SIZE];
+	uint64_t offset = MIDI_HEADER_SIZE;
+	size_t track_memory;
+
+	memset(self, 0, sizeof(struct midi_stream));
+
+	self->fd = open(path, O_RDONLY);
+	if (self->fd < 0) {
+		printf("Error %d opening %s: %s\n", errno, path, strerror(errno));
+		return NULL;
+	}
+
+	posix_fadvise(self->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (pread(self->fd, header, MIDI_HEADER_SIZE, 0) != MIDI_HEADER_SIZE || memcmp(header, "MThd", 4)) {
+		midi_status = MIDI_InvalidHeaderChunk;
+		midi_stream_free(self);
+		return NULL;
+	}
+
+	self->format = midi_stream_read16(header + 8);
+	self->track_count = midi_stream_read16(header + 10);
+	self->ticks_per_quarter = midi_stream_read16(header + 12);
+
+	if (self->ticks_per_quarter >= 0x8000 || !self->ticks_per_quarter || self->format >= 2) {
+		midi_status = MIDI_Unimplemented;
+		midi_stream_free(self);
+		return NULL;
+	}
+
+	// Every track needs its smallest buffer, which the window must leave room for.
+	track_memory = (MIDI_STREAM_BUFFER_MIN + sizeof(struct midi_stream_track) + sizeof(uint16_t)) * self->track_count;
+	if (memory < track_memory + MIDI_STREAM_WINDOW_MIN * sizeof(struct midi_stream_note)) {
+		printf("Error: streaming %u tracks needs at least %zu KiB\n", self->track_count,
+			(track_memory + MIDI_STREAM_WINDOW_MIN * sizeof(struct midi_stream_note) + 1023) / 1024);
+		midi_stream_free(self);
+		return NULL;
+	}
+
+	// A quarter of the budget for decoded events, the rest for read-ahead.
+	self->window_capacity = MIDI_MIN(memory / 4, memory - track_memory) / sizeof(struct midi_stream_note);
+	self->window_capacity = MIDI_MAX(self->window_capacity, MIDI_STREAM_WINDOW_MIN);
+	track_memory = memory - self->window_capacity * sizeof(struct midi_stream_note)
+		- (sizeof(struct midi_stream_track) + sizeof(uint16_t)) * self->track_count;
+	self->buffer_size = MIDI_MIN(track_memory / MIDI_MAX(self->track_count, 1), MIDI_STREAM_BUFFER_MAX);
+
+	self->tracks = (struct midi_stream_track *) calloc(self->track_count, sizeof(struct midi_stream_track));
+	self->buffers = (uint8_t *) malloc((size_t) self->buffer_size * self->track_count);
+	self->heap = (uint16_t *) malloc(sizeof(uint16_t) * self->track_count);
+	self->window = (struct midi_stream_note *) malloc(sizeof(struct midi_stream_note) * self->window_capacity);
+
+	if ((self->track_count && (!self->tracks || !self->buffers || !self->heap)) || !self->window) {
+		printf("Error allocating stream buffers\n");
+		midi_stream_free(self);
+		return NULL;
+	}
+
+	self->memory = (size_t) self->buffer_size * self->track_count
+		+ sizeof(struct midi_stream_note) * self->window_capacity
+		+ (sizeof(struct midi_stream_track) + sizeof(uint16_t)) * self->track_count;
+
+	// Default initial tempo is 120 BPM.
+	self->tempo = 60E6 / 120;
+
+	for (uint16_t i = 0; i < self->track_count; ++i) {
+		struct midi_stream_track *track = self->tracks + i;
+
+		if (pread(self->fd, header, MIDI_TRACK_HEADER_SIZE, offset) != MIDI_TRACK_HEADER_SIZE || memcmp(header, "MTrk", 4)) {
+			midi_status = MIDI_InvalidTrackChunk;
+			midi_stream_free(self);
+			return NULL;
+		}
+
+		track->buffer = self->buffers + (size_t) i * self->buffer_size;
+		track->offset = offset + MIDI_TRACK_HEADER_SIZE;
+		track->end = track->offset + midi_stream_read32(header + 4);
+		offset = track->end;
+
+		track->next_tick = midi_stream_value_read(self, track);
+		if (!track->over)
+			self->heap[self->heap_size++] = i;
+	}
+
+	for (uint32_t i = self->heap_size / 2; i--;)
+		midi_stream_heap_down(self, i);
+
+	midi_status = MIDI_Success;
+	return self;
+}
+
+/**
+Decode the next event in time order. Note events are appended to the window.
+Return 0 once every track is over.
+*/
+static int midi_stream_decode(struct midi_stream *self)
+{
+	struct midi_stream_track *track;
+	struct midi_stream_note *note;
+	uint8_t status, type, data[2];
+	uint32_t size;
+	uint64_t tick;
+
+	if (!self->heap_size)
+		return 0;
+
+	track = self->tracks + self->heap[0];
+	tick = track->next_tick;
+
+	status = midi_stream_getc(self, track);
+	if (status < 0x80) {
+		data[0] = status;
+		status = track->running_status;
+	} else {
+		data[0] = status < 0xF0 ? midi_stream_getc(self, track) : 0;
+		track->running_status = status < 0xF0 ? status : 0;
+	}
+
+	switch (status & 0xF0) {
+	case EventNoteOff:
+	case EventNoteOn:
+		data[1] = midi_stream_getc(self, track);
+
+		note = self->window + (self->window_head + self->window_count) % self->window_capacity;
+		note->time = midi_stream_time(self, tick);
+		note->status = status;
+		note->note = data[0] & 0x7F;
+		note->velocity = data[1] & 0x7F;
+
+		++self->window_count;
+		++self->events;
+		break;
+
+	case EventKeyPressure:
+	case EventControllerChange:
+	case EventPitchBend:
+		midi_stream_getc(self, track);
+		break;
+
+	case EventProgramChange:
+	case EventChannelPressure:
+		break;
+
+	case EventSystemExclusive:
+		if (status == 0xFF) {
+			type = midi_stream_getc(self, track);
+			size = midi_stream_value_read(self, track);
+
+			if (type == MetaEndOfTrack) {
+				track->over = 1;
+			} else if (type == MetaSetTempo && size == 3) {
+				self->tempo_time = midi_stream_time(self, tick);
+				self->tempo_tick = tick;
+				self->tempo = midi_stream_getc(self, track) << 16;
+				self->tempo |= midi_stream_getc(self, track) << 8;
+				self->tempo |= midi_stream_getc(self, track);
+			} else {
+				midi_stream_skip(self, track, size);
+			}
+		} else {
+			midi_stream_skip(self, track, midi_stream_value_read(self, track));
+		}
+		break;
+
+	default:
+		// Data byte without a running status, the track is corrupt.
+		track->over = 1;
+	}
+
+	// Tracks missing their end of track event just run out of bytes.
+	if (track->position == track->size && track->offset >= track->end)
+		track->over = 1;
+
+	if (!track->over)
+		track->next_tick = tick + midi_stream_value_read(self, track);
+
+	if (track->over)
+		self->heap[0] = self->heap[--self->heap_size];
+
+	midi_stream_heap_down(self, 0);
+	return 1;
+}
+
+/**
+Take the next note event out of the window, topping the window up first.
+Return 0 at the end of the file.
+*/
+static int midi_stream_next(struct midi_stream *self, struct midi_stream_note *note)
+{
+	struct midi_stream_note *first, *last;
+
+	for (int i = 0; i < MIDI_STREAM_DECODE_STEP && self->window_count < self->window_capacity; ++i) {
+		if (self->window_count) {
+			first = self->window + self->window_head;
+			last = self->window + (self->window_head + self->window_count - 1) % self->window_capacity;
+			if (last->time >= first->time + MIDI_STREAM_WINDOW)
+				break;
+		}
+
+		if (!midi_stream_decode(self))
+			break;
+	}
+
+	while (!self->window_count)
+		if (!midi_stream_decode(self))
+			return 0;
+
+	*note = self->window[self->window_head];
+	self->window_head = (self->window_head + 1) % self->window_capacity;
+	--self->window_count;
+	return 1;
+}
+
+static void midi_stream_stats_show(struct midi_stream *self, FILE *output)
+{
+	fprintf(output, "stream: %llu notes, %u tracks, %u KiB held, %u B per track, %llu refills, %llu MiB read\n",
+		(unsigned long long) self->events,
+		self->track_count,
+		(uint32_t) (self->memory / 1024),
+		self->buffer_size,
+		(unsigned long long) self->refills,
+		(unsigned long long) (self->bytes_read >> 20));
+}
+
+
+#endif /* MIDI_STREAM_H */
@@ -0,0 +1,188 @@
+#ifndef MIDI_WRITER_H
+#define MIDI_WRITER_H
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "midi_parser.h"
+
+
+#define MIDI_WRITER_BUFFER (256 << 10)
+// Longest event: four bytes of delta time, a status and two data bytes.
+#define MIDI_WRITER_EVENT_MAX 8
+// Offset of the length of the only MTrk chunk.
+#define MIDI_WRITER_TRACK_LENGTH 18
+#define MIDI_WRITER_HEADER_SIZE 22
+
+
+/**
+Standard MIDI File writer, format 0 with a single track.
+
+Events are encoded with delta times and running status into a buffer
+allocated once, which is written out in large sequential writes when it
+fills. The track length is patched in when the file is closed.
+*/
+struct midi_writer
+{
+	int fd;
+	const char *path;
+
+	uint8_t *buffer;
+	size_t size;
+	uint64_t written, flushes;
+
+	uint32_t us_per_tick;
+	// Time of the last event, in ticks.
+	uint64_t tick;
+	uint8_t running_status;
+	uint64_t events;
+};
+
+
+static int midi_writer_flush(struct midi_writer *self)
+{
+	ssize_t got;
+
+	for (size_t done = 0; done < self->size; done += got) {
+		got = write(self->fd, self->buffer + done, self->size - done);
+		if (got < 0) {
+			if (errno == EINTR) {
+				got = 0;
+				continue;
+			}
+
+			printf("Error %d writing %s: %s\n", errno, self->path, strerror(errno));
+			return -1;
+		}
+	}
+
+	self->written += self->size;
+	self->size = 0;
+	++self->flushes;
+	return 0;
+}
+
+static inline void midi_writer_put(struct midi_writer *self, const void *data, size_t size)
+{
+	memcpy(self->buffer + self->size, data, size);
+	self->size += size;
+}
+
+/// Append a variable length quantity, at most 0x0FFFFFFF.
+static inline void midi_writer_value(struct midi_writer *self, uint32_t value)
+{
+	uint8_t bytes[4];
+	size_t count = 0;
+
+	value = value > 0x0FFFFFFF ? 0x0FFFFFFF : value;
+
+	do {
+		bytes[count++] = value & 0x7F;
+		value >>= 7;
+	} while (value);
+
+	while (count-- > 1)
+		self->buffer[self->size++] = bytes[count] | 0x80;
+
+	self->buffer[self->size++] = bytes[0];
+}
+
+/**
+Create `path` with `ticks_per_quarter` ticks per quarter note at `tempo`
+micro seconds per quarter note.
+Return `self`, or NULL on error.
+*/
+static struct midi_writer *midi_writer_new(struct midi_writer *self, const char *path, uint16_t ticks_per_quarter, uint32_t tempo)
+{
+	uint8_t header[MIDI_WRITER_HEADER_SIZE] = {
+		'M', 'T', 'h', 'd', 0, 0, 0, 6,
+		// Format 0, one track.
+		0, 0, 0, 1, ticks_per_quarter >> 8 & 0x7F, ticks_per_quarter & 0xFF,
+		// Length patched in on close.
+		'M', 'T', 'r', 'k', 0, 0, 0, 0
+	};
+	uint8_t set_tempo[7] = { 0, 0xFF, MetaSetTempo, 3, tempo >> 16 & 0xFF, tempo >> 8 & 0xFF, tempo & 0xFF };
+
+	memset(self, 0, sizeof(struct midi_writer));
+	self->path = path;
+	self->us_per_tick = tempo / ticks_per_quarter;
+
+	self->buffer = (uint8_t *) malloc(MIDI_WRITER_BUFFER);
+	if (!self->buffer) {
+		printf("Error allocating the buffer of %s\n", path);
+		return NULL;
+	}
+
+	self->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (self->fd < 0) {
+		printf("Error %d creating %s: %s\n", errno, path, strerror(errno));
+		free(self->buffer);
+		return NULL;
+	}
+
+	midi_writer_put(self, header, sizeof(header));
+	midi_writer_put(self, set_tempo, sizeof(set_tempo));
+	return self;
+}
+
+/**
+Append a channel message of `size` data bytes at `time` micro seconds.
+Times must not go backwards.
+*/
+static int midi_writer_event(struct midi_writer *self, uint64_t time, uint8_t status, const uint8_t *data, uint8_t size)
+{
+	uint64_t tick = (time + self->us_per_tick / 2) / self->us_per_tick;
+
+	if (MIDI_WRITER_BUFFER - self->size < MIDI_WRITER_EVENT_MAX && midi_writer_flush(self))
+		return -1;
+
+	midi_writer_value(self, tick > self->tick ? tick - self->tick : 0);
+	self->tick = tick > self->tick ? tick : self->tick;
+
+	if (status != self->running_status)
+		self->buffer[self->size++] = status;
+
+	self->running_status = status;
+	midi_writer_put(self, data, size);
+	++self->events;
+	return 0;
+}
+
+/// End the track, write out the rest and patch the track length in.
+static int midi_writer_close(struct midi_writer *self)
+{
+	uint8_t end_of_track[4] = { 0, 0xFF, MetaEndOfTrack, 0 }, length[4];
+	uint64_t track_size;
+	int status = 0;
+
+	if (MIDI_WRITER_BUFFER - self->size < sizeof(end_of_track))
+		status = midi_writer_flush(self);
+
+	midi_writer_put(self, end_of_track, sizeof(end_of_track));
+	status = status || midi_writer_flush(self) ? -1 : 0;
+
+	track_size = self->written - MIDI_WRITER_HEADER_SIZE;
+	length[0] = track_size >> 24 & 0xFF;
+	length[1] = track_size >> 16 & 0xFF;
+	length[2] = track_size >> 8 & 0xFF;
+	length[3] = track_size & 0xFF;
+
+	if (!status && pwrite(self->fd, length, sizeof(length), MIDI_WRITER_TRACK_LENGTH) != sizeof(length)) {
+		printf("Error %d finishing %s: %s\n", errno, self->path, strerror(errno));
+		status = -1;
+	}
+
+	close(self->fd);
+	free(self->buffer);
+	self->buffer = NULL;
+	return status;
+}
+
+
+#endif /* MIDI_WRITER_H */
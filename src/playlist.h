@@ -0,0 +1,146 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "midi_parser.h"
+#include "midi_file.h"
+
+
+struct playlist_track
+{
+	const char *path;
+	uint8_t ready;
+
+	struct midi_file file[1];
+	struct midi_parser parser[1];
+};
+
+
+/**
+Tracks played back to back. While one track plays the next one is read
+into memory and its parser set up on a background thread, so switching
+tracks costs nothing but a thread join.
+*/
+struct playlist
+{
+	char **paths;
+	size_t count, index;
+
+	struct playlist_track tracks[2];
+	pthread_t thread;
+	uint8_t prefetching;
+};
+
+
+static void *playlist_track_load(void *argument)
+{
+	struct playlist_track *self = (struct playlist_track *) argument;
+	FILE *midi;
+
+	self->ready = 0;
+
+	midi = fopen(self->path, "rb");
+	if (!midi)
+		return NULL;
+
+	// The slot held an earlier track; a track without a tempo event plays at 120 BPM, not at its tempo.
+	memset(self->parser, 0, sizeof(struct midi_parser));
+
+	if (midi_file_load(self->file, midi) && midi_parser_new(self->parser, self->file->stream)
+	&& self->parser->ticks_per_quarter) {
+		self->parser->us_per_tick = 60E6 / 120 / self->parser->ticks_per_quarter;
+		self->ready = 1;
+	}
+
+	fclose(midi);
+	return NULL;
+}
+
+static void playlist_prefetch(struct playlist *self, size_t index)
+{
+	struct playlist_track *track = self->tracks + index % 2;
+	struct sched_param param = { .sched_priority = 0 };
+	pthread_attr_t attributes;
+	cpu_set_t cpus;
+
+	midi_file_free(track->file);
+	track->path = self->paths[index];
+
+	// Playback may run real time pinned to one CPU; the loader must not inherit that and compete with it.
+	CPU_ZERO(&cpus);
+	for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_CONF) && cpu < CPU_SETSIZE; ++cpu)
+		CPU_SET(cpu, &cpus);
+
+	pthread_attr_init(&attributes);
+	pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attributes, SCHED_OTHER);
+	pthread_attr_setschedparam(&attributes, &param);
+	pthread_attr_setaffinity_np(&attributes, sizeof(cpu_set_t), &cpus);
+
+	self->prefetching = pthread_create(&self->thread, &attributes, playlist_track_load, track) == 0;
+	pthread_attr_destroy(&attributes);
+
+	// No thread to spare, load it now.
+	if (!self->prefetching)
+		playlist_track_load(track);
+}
+
+static void playlist_new(struct playlist *self, char **paths, size_t count)
+{
+	memset(self, 0, sizeof(struct playlist));
+	self->paths = paths;
+	self->count = count;
+
+	if (self->count)
+		playlist_prefetch(self, 0);
+}
+
+/**
+Return the next track ready to play and start loading the one after it,
+or NULL at the end of the playlist. Tracks that fail to load are skipped.
+*/
+static struct playlist_track *playlist_next(struct playlist *self)
+{
+	struct playlist_track *track;
+
+	while (self->index < self->count) {
+		if (self->prefetching) {
+			pthread_join(self->thread, NULL);
+			self->prefetching = 0;
+		}
+
+		track = self->tracks + self->index % 2;
+		++self->index;
+
+		if (self->index < self->count)
+			playlist_prefetch(self, self->index);
+
+		if (track->ready)
+			return track;
+
+		printf("Error loading %s\n", track->path);
+	}
+
+	return NULL;
+}
+
+static void playlist_free(struct playlist *self)
+{
+	if (self->prefetching) {
+		pthread_join(self->thread, NULL);
+		self->prefetching = 0;
+	}
+
+	midi_file_free(self->tracks[0].file);
+	midi_file_free(self->tracks[1].file);
+}
+
+
+#endif /* PLAYLIST_H */
@@ -0,0 +1,294 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define RASTER_X86
+#endif
+
+#include "timeline.h"
+
+
+/// One bit per MIDI note, bit `n % 64` of `word[n / 64]`.
+struct raster_keys
+{
+	uint64_t word[2];
+}
+__attribute__((aligned(16)));
+
+
+struct raster_stats
+{
+	uint64_t onsets;
+	uint32_t max_polyphony, max_onsets;
+	double mean_polyphony;
+};
+
+
+/// Pack, fill and diff loops for one instruction set.
+struct raster_kernel
+{
+	const char *name;
+	struct raster_keys (*pack)(const uint8_t *);
+	void (*fill)(struct raster_keys *, struct raster_keys, size_t);
+	void (*diff)(const struct raster_keys *, struct raster_keys *, size_t);
+};
+
+
+/**
+A timeline sampled at a fixed frame rate into key bitsets.
+
+A key is down in a frame if it is held when the frame starts or struck
+during it, so notes shorter than a frame are not lost. Events only store
+to a byte per key, which no later event waits on, and each frame with
+events is packed from the top bits of those bytes. Long runs of
+frames without events are filled with vector stores, and the diffs and
+statistics work on whole frames at a time.
+*/
+struct raster
+{
+	struct raster_keys *frames;
+	size_t count;
+	uint32_t fps;
+
+	const struct raster_kernel *kernel;
+};
+
+
+static inline void raster_keys_set(struct raster_keys *self, uint8_t note)
+{
+	self->word[note >> 6 & 1] |= (uint64_t) 1 << (note & 63);
+}
+
+static inline void raster_keys_clear(struct raster_keys *self, uint8_t note)
+{
+	self->word[note >> 6 & 1] &= ~((uint64_t) 1 << (note & 63));
+}
+
+static inline uint32_t raster_keys_count(const struct raster_keys *self)
+{
+	return __builtin_popcountll(self->word[0]) + __builtin_popcountll(self->word[1]);
+}
+
+
+/// Bit `n` is the top bit of `keys[n]`.
+static struct raster_keys raster_pack_scalar(const uint8_t *keys)
+{
+	struct raster_keys packed = { { 0, 0 } };
+	uint64_t bytes;
+
+	// The multiply moves the top bit of byte `i` to bit 56 + `i`, eight keys at a time.
+	for (uint32_t i = 0; i < 16; ++i) {
+		memcpy(&bytes, keys + i * 8, sizeof(bytes));
+		packed.word[i >> 3] |= ((bytes & 0x8080808080808080ULL) * 0x0002040810204081ULL >> 56) << (i & 7) * 8;
+	}
+
+	return packed;
+}
+
+static void raster_fill_scalar(struct raster_keys *frames, struct raster_keys keys, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		frames[i] = keys;
+}
+
+/// `onsets[i]` is what `frames[i]` adds to `frames[i - 1]`.
+static void raster_diff_scalar(const struct raster_keys *frames, struct raster_keys *onsets, size_t count)
+{
+	for (size_t i = 1; i < count; ++i) {
+		onsets[i].word[0] = frames[i].word[0] & ~frames[i - 1].word[0];
+		onsets[i].word[1] = frames[i].word[1] & ~frames[i - 1].word[1];
+	}
+}
+
+#ifdef RASTER_X86
+static struct raster_keys raster_pack_sse2(const uint8_t *keys)
+{
+	struct raster_keys packed = { { 0, 0 } };
+
+	for (uint32_t i = 0; i < 4; ++i) {
+		packed.word[0] |= (uint64_t) _mm_movemask_epi8(_mm_load_si128((const __m128i *) keys + i)) << i * 16;
+		packed.word[1] |= (uint64_t) _mm_movemask_epi8(_mm_load_si128((const __m128i *) keys + i + 4)) << i * 16;
+	}
+
+	return packed;
+}
+
+static void raster_fill_sse2(struct raster_keys *frames, struct raster_keys keys, size_t count)
+{
+	__m128i value = _mm_load_si128((const __m128i *) &keys);
+
+	for (size_t i = 0; i < count; ++i)
+		_mm_store_si128((__m128i *) (frames + i), value);
+}
+
+static void raster_diff_sse2(const struct raster_keys *frames, struct raster_keys *onsets, size_t count)
+{
+	__m128i previous, current;
+
+	for (size_t i = 1; i < count; ++i) {
+		previous = _mm_load_si128((const __m128i *) (frames + i - 1));
+		current = _mm_load_si128((const __m128i *) (frames + i));
+		_mm_store_si128((__m128i *) (onsets + i), _mm_andnot_si128(previous, current));
+	}
+}
+
+__attribute__((target("avx2")))
+static struct raster_keys raster_pack_avx2(const uint8_t *keys)
+{
+	struct raster_keys packed;
+
+	for (uint32_t i = 0; i < 2; ++i) {
+		packed.word[i] = (uint32_t) _mm256_movemask_epi8(_mm256_load_si256((const __m256i *) keys + i * 2))
+			| (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_load_si256((const __m256i *) keys + i * 2 + 1)) << 32;
+	}
+
+	return packed;
+}
+
+__attribute__((target("avx2")))
+static void raster_fill_avx2(struct raster_keys *frames, struct raster_keys keys, size_t count)
+{
+	__m128i half = _mm_load_si128((const __m128i *) &keys);
+	__m256i value = _mm256_broadcastsi128_si256(half);
+	size_t i = 0;
+
+	for (; i + 2 <= count; i += 2)
+		_mm256_storeu_si256((__m256i *) (frames + i), value);
+
+	if (i < count)
+		_mm_store_si128((__m128i *) (frames + i), half);
+}
+
+__attribute__((target("avx2")))
+static void raster_diff_avx2(const struct raster_keys *frames, struct raster_keys *onsets, size_t count)
+{
+	__m256i previous, current;
+	size_t i = 1;
+
+	for (; i + 2 <= count; i += 2) {
+		previous = _mm256_loadu_si256((const __m256i *) (frames + i - 1));
+		current = _mm256_loadu_si256((const __m256i *) (frames + i));
+		_mm256_storeu_si256((__m256i *) (onsets + i), _mm256_andnot_si256(previous, current));
+	}
+
+	raster_diff_sse2(frames + i - 1, onsets + i - 1, count - i + 1);
+}
+#endif
+
+/// From the narrowest, every kernel up to the one raster_kernel_select picks runs here.
+static const struct raster_kernel raster_kernels[] = {
+	{ "scalar", raster_pack_scalar, raster_fill_scalar, raster_diff_scalar },
+#ifdef RASTER_X86
+	{ "sse2", raster_pack_sse2, raster_fill_sse2, raster_diff_sse2 },
+	{ "avx2", raster_pack_avx2, raster_fill_avx2, raster_diff_avx2 },
+#endif
+};
+
+/// The widest kernel the CPU runs.
+static const struct raster_kernel *raster_kernel_select(void)
+{
+	#ifdef RASTER_X86
+		if (__builtin_cpu_supports("avx2"))
+			return raster_kernels + 2;
+		if (__builtin_cpu_supports("sse2"))
+			return raster_kernels + 1;
+	#endif
+
+	return raster_kernels;
+}
+
+static void raster_free(struct raster *self)
+{
+	free(self->frames);
+	memset(self, 0, sizeof(struct raster));
+}
+
+/**
+Sample `timeline` at `fps` frames per second with `kernel`.
+Return `self`, or NULL on error.
+*/
+static struct raster *raster_new(struct raster *self, const struct timeline *timeline, uint32_t fps, const struct raster_kernel *kernel)
+{
+	const struct midi_stream_note *note = timeline->notes, *end = timeline->notes + timeline->count;
+	// All ones for a key down, aligned for the vector packs.
+	_Alignas(32) uint8_t held[128] = { 0 }, keys[128];
+	uint64_t frame_end;
+	size_t index, next;
+
+	memset(self, 0, sizeof(struct raster));
+	self->fps = fps;
+	self->kernel = kernel;
+	self->count = timeline->duration * fps / 1000000 + 1;
+	self->frames = (struct raster_keys *) aligned_alloc(sizeof(struct raster_keys), sizeof(struct raster_keys) * self->count);
+
+	if (!self->frames) {
+		printf("Error allocating %zu frames\n", self->count);
+		return NULL;
+	}
+
+	for (index = 0; index < self->count; index = next) {
+		// Keys held at the start of the frame, plus any struck during it.
+		memcpy(keys, held, sizeof(keys));
+		frame_end = ((index + 1) * 1000000 + fps - 1) / fps;
+
+		for (; note < end && note->time < frame_end; ++note) {
+			if (timeline_note_on(note))
+				held[note->note] = keys[note->note] = 0xFF;
+			else
+				held[note->note] = 0;
+		}
+
+		self->frames[index] = kernel->pack(keys);
+
+		// Nothing changes until the frame of the next event.
+		next = note < end ? note->time * fps / 1000000 : self->count;
+		if (next > index + 1)
+			kernel->fill(self->frames + index + 1, kernel->pack(held), next - index - 1);
+		else
+			next = index + 1;
+	}
+
+	return self;
+}
+
+/// Polyphony and onset density over the whole raster.
+static void raster_stats_compute(const struct raster *self, struct raster_stats *stats)
+{
+	struct raster_keys *onsets;
+	uint64_t polyphony = 0;
+	uint32_t count;
+
+	memset(stats, 0, sizeof(struct raster_stats));
+	if (!self->count)
+		return;
+
+	onsets = (struct raster_keys *) aligned_alloc(sizeof(struct raster_keys), sizeof(struct raster_keys) * self->count);
+	if (!onsets)
+		return;
+
+	onsets[0] = self->frames[0];
+	self->kernel->diff(self->frames, onsets, self->count);
+
+	for (size_t i = 0; i < self->count; ++i) {
+		count = raster_keys_count(self->frames + i);
+		polyphony += count;
+		stats->max_polyphony = MIDI_MAX(stats->max_polyphony, count);
+
+		count = raster_keys_count(onsets + i);
+		stats->onsets += count;
+		stats->max_onsets = MIDI_MAX(stats->max_onsets, count);
+	}
+
+	stats->mean_polyphony = (double) polyphony / self->count;
+	free(onsets);
+}
+
+
+#endif /* RASTER_H */
@@ -0,0 +1,224 @@
+#ifndef ROLL_H
+#define ROLL_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timeline.h"
+
+
+// Notes of one key sounding together, at most one per channel.
+#define ROLL_LAYERS 16
+
+
+struct roll_note
+{
+	uint64_t start, end;
+	uint8_t note, channel, velocity;
+};
+
+
+/// Notes `notes[first]` up to `notes[last]`.
+struct roll_span
+{
+	size_t first, last;
+};
+
+
+/**
+Index of the notes of a piece as intervals, paired once at load time.
+
+The notes of each key are split into layers sorted on their start in
+which the ends never decrease either, so both edges of a time window are
+found by binary search and everything between them overlaps it. A note
+lasting over later ones, such as one never released, goes to a deeper
+layer. A layer is only needed for each note sounding at once, so there
+are at most one per channel, and listing the notes overlapping a window
+costs O(log n + k) per key.
+*/
+struct roll
+{
+	struct roll_note *notes;
+	size_t count;
+
+	// Layer `l` of key `k` is `notes[offsets[k * ROLL_LAYERS + l]]` up to the next offset.
+	size_t offsets[128 * ROLL_LAYERS + 1];
+};
+
+
+static void roll_free(struct roll *self)
+{
+	free(self->notes);
+	memset(self, 0, sizeof(struct roll));
+}
+
+/// Sort the notes of each key on their layer, keeping them sorted on their start.
+static void roll_layer(struct roll *self, struct roll_note *notes, const uint8_t *layers)
+{
+	size_t *fill = self->offsets;
+
+	for (size_t i = 0; i < self->count; ++i)
+		++fill[notes[i].note * ROLL_LAYERS + layers[i] + 1];
+
+	for (size_t i = 0; i < 128 * ROLL_LAYERS; ++i)
+		fill[i + 1] += fill[i];
+
+	for (size_t i = 0; i < self->count; ++i)
+		self->notes[fill[notes[i].note * ROLL_LAYERS + layers[i]]++] = notes[i];
+
+	// Each offset moved to the next one, move them back.
+	memmove(fill + 1, fill, sizeof(size_t) * 128 * ROLL_LAYERS);
+	fill[0] = 0;
+}
+
+/**
+Pair the note events of `timeline` into intervals.
+A note still held at the end of the piece ends with it.
+Return `self`, or NULL on error.
+*/
+static struct roll *roll_new(struct roll *self, const struct timeline *timeline)
+{
+	const struct midi_stream_note *event;
+	struct roll_note *notes, *note;
+	uint64_t *last_end;
+	size_t *open, count = 0;
+	uint8_t *layers, key, channel, layer;
+
+	memset(self, 0, sizeof(struct roll));
+
+	// Every note-on opens a note.
+	for (size_t i = 0; i < timeline->count; ++i)
+		self->count += timeline_note_on(timeline->notes + i);
+
+	self->notes = (struct roll_note *) malloc(sizeof(struct roll_note) * MIDI_MAX(self->count, 1));
+	notes = (struct roll_note *) malloc(sizeof(struct roll_note) * MIDI_MAX(self->count, 1));
+	layers = (uint8_t *) malloc(MIDI_MAX(self->count, 1));
+
+	// Open note per key and channel plus one, and end of the last note of each layer.
+	open = (size_t *) calloc(16 * 128, sizeof(size_t));
+	last_end = (uint64_t *) calloc(128 * ROLL_LAYERS, sizeof(uint64_t));
+
+	if (!self->notes || !notes || !layers || !open || !last_end) {
+		printf("Error allocating the note index\n");
+		free(notes);
+		free(layers);
+		free(open);
+		free(last_end);
+		roll_free(self);
+		return NULL;
+	}
+
+	// Pair the events in time order, so the notes come out sorted on their start.
+	for (size_t i = 0; i < timeline->count; ++i) {
+		event = timeline->notes + i;
+		key = event->note;
+		channel = event->status & 0x0F;
+
+		// A retrigger ends the note still sounding on the key.
+		if (open[channel * 128 + key]) {
+			notes[open[channel * 128 + key] - 1].end = event->time;
+			open[channel * 128 + key] = 0;
+		}
+
+		if (!timeline_note_on(event))
+			continue;
+
+		note = notes + count;
+		note->start = event->time;
+		note->end = timeline->duration;
+		note->note = key;
+		note->channel = channel;
+		note->velocity = event->velocity;
+
+		open[channel * 128 + key] = ++count;
+	}
+
+	/*
+	The first layer whose last note ends no later than this one. Their last
+	ends decrease with depth, and the notes a deeper layer is opened for all
+	sound at its start on distinct channels, so ROLL_LAYERS are enough.
+	*/
+	for (size_t i = 0; i < count; ++i) {
+		note = notes + i;
+		for (layer = 0; layer < ROLL_LAYERS - 1 && last_end[note->note * ROLL_LAYERS + layer] > note->end; ++layer);
+
+		last_end[note->note * ROLL_LAYERS + layer] = note->end;
+		layers[i] = layer;
+	}
+
+	roll_layer(self, notes, layers);
+
+	free(notes);
+	free(layers);
+	free(open);
+	free(last_end);
+	return self;
+}
+
+/**
+Find the notes of `key` overlapping [from, to), in at most ROLL_LAYERS spans.
+Return the number of spans filled in.
+*/
+static size_t roll_range(const struct roll *self, uint8_t key, uint64_t from, uint64_t to, struct roll_span *spans)
+{
+	size_t low, high, middle, count = 0;
+
+	for (size_t layer = key * ROLL_LAYERS; layer < (key + 1) * ROLL_LAYERS; ++layer) {
+		// First note ending after `from`.
+		low = self->offsets[layer];
+		high = self->offsets[layer + 1];
+		while (low < high) {
+			middle = low + (high - low) / 2;
+			if (self->notes[middle].end <= from)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		spans[count].first = low;
+
+		// First note starting at or after `to`.
+		high = self->offsets[layer + 1];
+		while (low < high) {
+			middle = low + (high - low) / 2;
+			if (self->notes[middle].start < to)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		spans[count].last = low;
+
+		count += spans[count].first < spans[count].last;
+	}
+
+	return count;
+}
+
+/// First note of `key` starting at or after `time`, or NULL.
+static inline const struct roll_note *roll_next(const struct roll *self, uint8_t key, uint64_t time)
+{
+	const struct roll_note *next = NULL;
+	size_t low, high, middle;
+
+	for (size_t layer = key * ROLL_LAYERS; layer < (key + 1) * ROLL_LAYERS; ++layer) {
+		low = self->offsets[layer];
+		high = self->offsets[layer + 1];
+		while (low < high) {
+			middle = low + (high - low) / 2;
+			if (self->notes[middle].start < time)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+
+		if (low < self->offsets[layer + 1] && (!next || self->notes[low].start < next->start))
+			next = self->notes + low;
+	}
+
+	return next;
+}
+
+
+#endif /* ROLL_H */
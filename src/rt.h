@@ -0,0 +1,91 @@
+#ifndef RT_H
+#define RT_H
+
+
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+#define RT_PRIORITY 50
+
+// Stack touched up front so playback never faults a new stack page in.
+#define RT_STACK_PREFAULT (256 * 1024)
+
+
+/**
+Real time settings for the playback thread. Every step is best effort,
+what could not be enabled is reported and playback carries on without it.
+*/
+struct rt
+{
+	int cpu;
+
+	uint8_t scheduler, affinity, locked;
+};
+
+
+static void rt_new(struct rt *self, int cpu)
+{
+	memset(self, 0, sizeof(struct rt));
+	self->cpu = cpu;
+}
+
+/// Fault in `RT_STACK_PREFAULT` bytes of stack below the caller.
+static uint8_t __attribute__((noinline)) rt_stack_prefault(void)
+{
+	volatile uint8_t stack[RT_STACK_PREFAULT];
+
+	for (size_t i = 0; i < RT_STACK_PREFAULT; i += 4096)
+		stack[i] = 0;
+
+	return stack[0];
+}
+
+static void rt_enable(struct rt *self, FILE *output)
+{
+	struct sched_param param = { .sched_priority = RT_PRIORITY };
+	cpu_set_t cpus;
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param) == 0)
+		self->scheduler = 1;
+	else
+		fprintf(output, "rt: could not enable SCHED_FIFO: %s\n", strerror(errno));
+
+	if (self->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(self->cpu, &cpus);
+
+		if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus) == 0)
+			self->affinity = 1;
+		else
+			fprintf(output, "rt: could not pin to cpu %d: %s\n", self->cpu, strerror(errno));
+	}
+
+	// Keep freed memory mapped, so later allocations reuse locked pages.
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+		self->locked = 1;
+	else
+		fprintf(output, "rt: could not lock memory: %s\n", strerror(errno));
+
+	rt_stack_prefault();
+}
+
+static void rt_stats_show(struct rt *self, uint32_t max_lateness, FILE *output)
+{
+	fprintf(output, "rt: SCHED_FIFO %s, cpu %s, memory %s, worst wakeup latency %u us\n",
+		self->scheduler ? "on" : "off",
+		self->affinity ? "pinned" : "not pinned",
+		self->locked ? "locked" : "not locked",
+		max_lateness);
+}
+
+
+#endif /* RT_H */
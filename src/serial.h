@@ -4,12 +4,59 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <termios.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 
+// Time to wait for the device to grant its first credits.
+// Opening the port resets most boards, so leave room for the bootloader.
+#define SERIAL_FLOW_OPEN_TIMEOUT 3000
+
+// Time to wait for credits once the session is running.
+#define SERIAL_FLOW_TIMEOUT 1000
+
+// Asks the device for its free space, a LED index no device has.
+#define SERIAL_FLOW_REQUEST 0x7F
+// Marks the answer, the free space in the low bits, apart from plain grants.
+#define SERIAL_FLOW_FREE 0x80
+// Time between requests until the device answers, in milli seconds.
+#define SERIAL_FLOW_REQUEST_INTERVAL 250
+
+
+/**
+Credit based flow control.
+
+The device grants credits by writing a byte holding the number of bytes
+it has consumed from its receive buffer. The host never has more bytes
+in flight than it holds credits, so the device buffer cannot overrun
+while it is busy with the LEDs.
+
+The initial grant is asked for: until the device first answers, the host
+sends `SERIAL_FLOW_REQUEST` every `SERIAL_FLOW_REQUEST_INTERVAL`, and the
+device answers each with `SERIAL_FLOW_FREE` or'ed with its free space.
+Answers set the credits rather than add to them, so repeated requests
+cannot grant twice, and are ignored once the host has sent anything.
+This works whether or not opening the port resets the board; a board
+still in its bootloader just misses the first requests.
+*/
+struct serial_flow
+{
+	int fd;
+	uint8_t enabled;
+	uint8_t granted;
+	uint32_t credits;
+	// Monotonic time of the last request, in milli seconds.
+	uint64_t requested;
+
+	uint64_t bytes_sent, credit_stalls;
+};
+
+
 static int serial_interface_set(int fd, int speed, int parity)
 {
 	struct termios tty;
@@ -83,4 +130,127 @@ static void serial_blocking_set(int fd, int should_block)
 }
 
 
+static void serial_flow_new(struct serial_flow *self, int fd, uint8_t enabled)
+{
+	memset(self, 0, sizeof(struct serial_flow));
+	self->fd = fd;
+	self->enabled = enabled;
+}
+
+/// Ask for the initial grant, at most once per `SERIAL_FLOW_REQUEST_INTERVAL`.
+static void serial_flow_request(struct serial_flow *self)
+{
+	uint8_t request = SERIAL_FLOW_REQUEST;
+	struct timespec now;
+	uint64_t clock;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	clock = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+	if (self->requested && clock - self->requested < SERIAL_FLOW_REQUEST_INTERVAL)
+		return;
+
+	self->requested = clock;
+	if (write(self->fd, &request, 1) != 1)
+		printf("Error %d asking the device for credits: %s\n", errno, strerror(errno));
+}
+
+/**
+Collect the credits granted by the device, waiting at most `timeout_ms` for some to arrive.
+Return the number of credits now held, or -1 on error.
+*/
+static int serial_flow_poll(struct serial_flow *self, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = self->fd, .events = POLLIN };
+	uint8_t grants[64];
+	ssize_t size;
+	int wait, ready;
+
+	if (!self->enabled)
+		return INT32_MAX;
+
+	for (;;) {
+		// Until the first answer, wake up to ask again.
+		if (!self->granted)
+			serial_flow_request(self);
+
+		wait = self->granted || timeout_ms < SERIAL_FLOW_REQUEST_INTERVAL ? timeout_ms : SERIAL_FLOW_REQUEST_INTERVAL;
+		ready = poll(&pfd, 1, wait);
+
+		if (ready <= 0) {
+			if (ready < 0 || self->granted || !timeout_ms)
+				break;
+
+			timeout_ms -= wait;
+			continue;
+		}
+
+		size = read(self->fd, grants, sizeof(grants));
+		if (size <= 0)
+			break;
+
+		for (ssize_t i = 0; i < size; ++i) {
+			if (!(grants[i] & SERIAL_FLOW_FREE))
+				self->credits += grants[i];
+			else if (!self->bytes_sent)
+				self->credits = grants[i] & ~SERIAL_FLOW_FREE;
+		}
+
+		self->granted = 1;
+		timeout_ms = 0;
+	}
+
+	return self->credits;
+}
+
+/**
+Write `size` bytes as fast as the credits allow.
+Return 0 on success, or -1 if the device stopped granting credits.
+*/
+static int serial_flow_write(struct serial_flow *self, const uint8_t *data, size_t size)
+{
+	size_t chunk;
+	ssize_t written;
+
+	while (size) {
+		if (self->enabled && !self->credits) {
+			++self->credit_stalls;
+
+			serial_flow_poll(self, self->granted ? SERIAL_FLOW_TIMEOUT : SERIAL_FLOW_OPEN_TIMEOUT);
+			if (!self->credits) {
+				printf("Error: no flow control credits from the device\n");
+				return -1;
+			}
+		}
+
+		chunk = self->enabled && self->credits < size ? self->credits : size;
+
+		written = write(self->fd, data, chunk);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			printf("Error %d writing to the device: %s\n", errno, strerror(errno));
+			return -1;
+		}
+
+		if (self->enabled)
+			self->credits -= written;
+
+		self->bytes_sent += written;
+		data += written;
+		size -= written;
+	}
+
+	return 0;
+}
+
+/// Give up the credits left over. Used by devices granting one frame at a time.
+static inline void serial_flow_release(struct serial_flow *self)
+{
+	if (self->enabled)
+		self->credits = 0;
+}
+
+
 #endif  /* SERIAL_H */
\ No newline at end of file
@@ -0,0 +1,102 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_stream.h"
+
+
+#define TIMELINE_CAPACITY 4096
+
+
+/**
+Every note event of a file decoded up front, in time order.
+For the views that need random access to the whole piece.
+*/
+struct timeline
+{
+	struct midi_stream_note *notes;
+	size_t count, capacity;
+
+	// Time of the last note event, in micro seconds.
+	uint64_t duration;
+};
+
+
+static void timeline_free(struct timeline *self)
+{
+	free(self->notes);
+	memset(self, 0, sizeof(struct timeline));
+}
+
+/**
+Decode `path` into the timeline.
+Return `self`, or NULL on error.
+*/
+static struct timeline *timeline_load(struct timeline *self, const char *path)
+{
+	struct midi_stream stream[1];
+	struct midi_stream_note *notes;
+
+	memset(self, 0, sizeof(struct timeline));
+
+	if (!midi_stream_open(stream, path, MIDI_STREAM_MEMORY))
+		return NULL;
+
+	self->capacity = TIMELINE_CAPACITY;
+	self->notes = (struct midi_stream_note *) malloc(sizeof(struct midi_stream_note) * self->capacity);
+
+	while (self->notes && midi_stream_next(stream, self->notes + self->count)) {
+		if (++self->count < self->capacity)
+			continue;
+
+		self->capacity *= 2;
+		notes = (struct midi_stream_note *) realloc(self->notes, sizeof(struct midi_stream_note) * self->capacity);
+		if (!notes)
+			free(self->notes);
+
+		self->notes = notes;
+	}
+
+	midi_stream_free(stream);
+
+	if (!self->notes) {
+		printf("Error allocating the timeline of %s\n", path);
+		timeline_free(self);
+		return NULL;
+	}
+
+	if (self->count)
+		self->duration = self->notes[self->count - 1].time;
+
+	return self;
+}
+
+/// Index of the first note event at or after `time`.
+static inline size_t timeline_search(const struct timeline *self, uint64_t time)
+{
+	size_t low = 0, high = self->count, middle;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		if (self->notes[middle].time < time)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+static inline uint8_t timeline_note_on(const struct midi_stream_note *note)
+{
+	return (note->status & 0xF0) == EventNoteOn && note->velocity != 0;
+}
+
+
+#endif /* TIMELINE_H */
@@ -0,0 +1,1194 @@
+// posix_openpt and friends.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// The modules are headers of static functions, each test uses a part of them.
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+#include "../src/link.h"
+#include "../src/color.h"
+#include "../src/playlist.h"
+#include "../src/keyboard_shm.h"
+#include "../src/raster.h"
+#include "../src/roll.h"
+#include "../src/daemon.h"
+#include "../src/midi_writer.h"
+
+
+// Device model, after arduino/arduino1.c and arduino/arduino3.c.
+#define SIM_RX_BUFFER 64
+#define SIM_CREDITS 48
+#define SIM_FRAME_SYNC 0xFF
+#define SIM_LEDS 88
+// 9600 baud with start and stop bits.
+#define SIM_BYTE_US (1000000 / 960)
+// FastLED.show() of 88 WS2812B pixels, 30 us each.
+#define SIM_SHOW (SIM_LEDS * 30)
+#define SIM_WIRE_SIZE 65536
+
+#define SHM_BENCH_NAME "/keyboard-shm-bench"
+#define SHM_TEST_NAME "/keyboard-shm-test"
+#define RASTER_BENCH_RUNS 5
+#define COLOR_BENCH_BUDGET 32
+#define ROLL_TEST_NOTES 200000
+
+#define TEST_WRITER_TICKS 960
+#define TEST_WRITER_TEMPO 480000
+
+#define TEST_CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			printf("%s:%d: %s failed\n", __func__, __LINE__, #condition); \
+			return 1; \
+		} \
+	} while (0)
+
+
+static uint64_t test_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/**
+Device simulator behind a pseudo terminal.
+
+Bytes written by the host reach the device at the wire rate and wait in
+a 64 byte receive buffer; whatever arrives while it is full is lost and
+counted as an overrun. In note mode the device applies up to its credit
+of bytes per show(), like arduino1.c; in frame mode it decodes RLE
+frames and grants a new frame after each show(), like arduino3.c.
+Either way it grants nothing until the host asks for its free space.
+*/
+struct sim
+{
+	int master;
+	uint8_t frames;
+	uint32_t show_us;
+
+	// Bytes written by the host, each with the time it reaches the device.
+	uint8_t wire[SIM_WIRE_SIZE];
+	uint64_t arrival[SIM_WIRE_SIZE];
+	size_t wire_head, wire_tail;
+	uint64_t wire_free;
+
+	uint8_t rx[SIM_RX_BUFFER];
+	size_t rx_head, rx_count;
+	uint64_t busy_until;
+
+	// Frame decoder.
+	uint8_t frame[2 + 5 * SIM_LEDS];
+	size_t frame_size, frame_expected;
+
+	uint8_t lit[SIM_LEDS];
+	uint64_t bytes, overruns, shows, frame_count, skipped, rx_max;
+};
+
+
+static int sim_grant(struct sim *self, uint8_t credits)
+{
+	if (write(self->master, &credits, 1) != 1) {
+		printf("Error %d granting credits: %s\n", errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void sim_show(struct sim *self, uint64_t now)
+{
+	self->busy_until = now + self->show_us;
+	++self->shows;
+}
+
+/// Apply a whole frame: sync, run count, then start, count, red, green, blue per run.
+static void sim_frame_apply(struct sim *self)
+{
+	uint8_t *run = self->frame + 2;
+
+	for (uint8_t i = 0; i < self->frame[1]; ++i, run += 5) {
+		for (size_t index = run[0]; index < (size_t) run[0] + run[1] && index < SIM_LEDS; ++index)
+			self->lit[index] = run[2] || run[3] || run[4];
+	}
+
+	++self->frame_count;
+}
+
+/// Feed one received byte to the frame decoder. Return 1 once a frame is complete.
+static uint8_t sim_frame_byte(struct sim *self, uint8_t byte)
+{
+	if (!self->frame_size && byte != SIM_FRAME_SYNC) {
+		++self->skipped;
+		return 0;
+	}
+
+	self->frame[self->frame_size++] = byte;
+	if (self->frame_size == 2)
+		self->frame_expected = 2 + 5 * (size_t) byte;
+
+	if (self->frame_size < 2 || self->frame_size < self->frame_expected)
+		return 0;
+
+	sim_frame_apply(self);
+	self->frame_size = 0;
+	return 1;
+}
+
+/// Run the device until `now`. Return 0, or -1 on error.
+static int sim_step(struct sim *self, uint64_t now)
+{
+	uint8_t byte, consumed = 0;
+
+	// The wire delivers into the receive buffer.
+	for (; self->wire_head != self->wire_tail && self->arrival[self->wire_head % SIM_WIRE_SIZE] <= now; ++self->wire_head) {
+		if (self->rx_count == SIM_RX_BUFFER) {
+			++self->overruns;
+			continue;
+		}
+
+		self->rx[(self->rx_head + self->rx_count++) % SIM_RX_BUFFER] = self->wire[self->wire_head % SIM_WIRE_SIZE];
+		self->rx_max = self->rx_count > self->rx_max ? self->rx_count : self->rx_max;
+	}
+
+	if (now < self->busy_until)
+		return 0;
+
+	while (self->rx_count && (self->frames || consumed < SIM_CREDITS)) {
+		byte = self->rx[self->rx_head];
+		self->rx_head = (self->rx_head + 1) % SIM_RX_BUFFER;
+		--self->rx_count;
+
+		// A request is not sent against credits, and only comes between frames.
+		if (byte == SERIAL_FLOW_REQUEST && !self->frame_size) {
+			if (sim_grant(self, SERIAL_FLOW_FREE | SIM_CREDITS))
+				return -1;
+
+			continue;
+		}
+
+		if (self->frames) {
+			if (sim_frame_byte(self, byte)) {
+				sim_show(self, now);
+				return sim_grant(self, SIM_CREDITS);
+			}
+
+			continue;
+		}
+
+		if ((byte & 0x7F) < SIM_LEDS)
+			self->lit[byte & 0x7F] = byte >> 7;
+
+		++consumed;
+	}
+
+	if (!consumed)
+		return 0;
+
+	sim_show(self, now);
+	return sim_grant(self, consumed);
+}
+
+/// Take what the host wrote onto the wire. Return the bytes read, 0 once it hung up, or -1 on error.
+static ssize_t sim_receive(struct sim *self, uint64_t now)
+{
+	uint8_t buffer[256];
+	ssize_t got = read(self->master, buffer, sizeof(buffer));
+
+	if (got < 0)
+		return errno == EIO ? 0 : -1;
+
+	for (ssize_t i = 0; i < got; ++i, ++self->wire_tail) {
+		self->wire_free = (self->wire_free > now ? self->wire_free : now) + SIM_BYTE_US;
+		self->wire[self->wire_tail % SIM_WIRE_SIZE] = buffer[i];
+		self->arrival[self->wire_tail % SIM_WIRE_SIZE] = self->wire_free;
+	}
+
+	self->bytes += got;
+	return got;
+}
+
+static void sim_stats_show(struct sim *self, FILE *output)
+{
+	uint32_t lit = 0;
+
+	for (size_t i = 0; i < SIM_LEDS; ++i)
+		lit += self->lit[i];
+
+	fprintf(output, "sim: %llu bytes, %llu overruns, rx max %llu, %llu shows, %u keys lit\n",
+		(unsigned long long) self->bytes, (unsigned long long) self->overruns,
+		(unsigned long long) self->rx_max, (unsigned long long) self->shows, lit);
+
+	if (self->frames)
+		fprintf(output, "sim: %llu frames, %.1f bytes/frame, %llu bytes skipped\n",
+			(unsigned long long) self->frame_count,
+			self->frame_count ? (double) self->bytes / self->frame_count : 0.0,
+			(unsigned long long) self->skipped);
+}
+
+/**
+Serve one host session on a new pseudo terminal, whose path is printed
+first. Each show() takes `show_us`, larger values model a slower device.
+Return 0 if the device lost nothing, 1 otherwise.
+*/
+static int sim_run(uint8_t frames, uint32_t show_us)
+{
+	static struct sim self[1];
+	struct pollfd pfd = { .events = POLLIN };
+	struct termios tty;
+	uint64_t now;
+	ssize_t got;
+
+	memset(self, 0, sizeof(struct sim));
+	self->frames = frames;
+	self->show_us = show_us;
+
+	self->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (self->master < 0 || grantpt(self->master) || unlockpt(self->master)) {
+		printf("Error %d creating a pseudo terminal: %s\n", errno, strerror(errno));
+		return 1;
+	}
+
+	// No echo, or the grants would come back as host bytes.
+	tcgetattr(self->master, &tty);
+	cfmakeraw(&tty);
+	tcsetattr(self->master, TCSANOW, &tty);
+
+	printf("%s\n", ptsname(self->master));
+	fflush(stdout);
+
+	// The master hangs up until the host opens the other side.
+	pfd.fd = self->master;
+	do {
+		usleep(10000);
+		poll(&pfd, 1, 0);
+	} while (pfd.revents & POLLHUP);
+
+	for (;;) {
+		poll(&pfd, 1, 1);
+		now = test_clock();
+
+		got = pfd.revents & POLLIN ? sim_receive(self, now) : 0;
+		if (got < 0) {
+			printf("Error %d reading from the host: %s\n", errno, strerror(errno));
+			return 1;
+		}
+
+		if (!got && pfd.revents & POLLHUP) {
+			// The host is gone, let the wire and the device run dry.
+			if (self->wire_head == self->wire_tail && !self->rx_count)
+				break;
+
+			usleep(1000);
+		}
+
+		if (sim_step(self, now))
+			return 1;
+	}
+
+	sim_stats_show(self, stdout);
+	close(self->master);
+	return self->overruns || self->skipped ? 1 : 0;
+}
+
+
+/// A release that jumps a saturated queue must not be followed by an older note-on of its key.
+static int test_link_release_order(void)
+{
+	struct serial_flow flow[1];
+	struct link link[1];
+	uint64_t now;
+	int fd = open("/dev/null", O_WRONLY);
+
+	serial_flow_new(flow, fd, 0);
+	link_new(link, flow, 9600, LINK_LATENCY_BUDGET);
+
+	// Key 60 is lit.
+	link_push(link, 60, 1, link_clock());
+	TEST_CHECK(!link_drain(link) && link->sent[60]);
+
+	// Queued under budget, so nothing is coalesced yet.
+	now = link_clock();
+	link_push(link, 60, 1, now);
+	link_push(link, 60, 0, now);
+
+	// Enough note-ons to saturate the link.
+	for (uint8_t note = 21; note < 101; ++note)
+		link_push(link, note == 60 ? 101 : note, 1, now);
+
+	TEST_CHECK(link_backlog(link, now) > link->latency_budget);
+	TEST_CHECK(!link_drain(link));
+
+	TEST_CHECK(link->sent[60] == 0);
+	TEST_CHECK(link->queued[60] == 0);
+
+	close(fd);
+	return 0;
+}
+
+/// Encode `engine` once and feed the frame to the simulated device. Return the frame size, or -1 if it was malformed.
+static int test_frame_send(struct color_engine *engine, struct sim *device)
+{
+	uint8_t frame[COLOR_FRAME_SIZE_MAX];
+	size_t size, frames = device->frame_count;
+
+	color_engine_tick(engine);
+	size = color_engine_encode(engine, frame, COLOR_FRAME_SIZE_MAX);
+
+	for (size_t i = 0; i < size; ++i)
+		sim_frame_byte(device, frame[i]);
+
+	if (device->skipped || device->frame_size || device->frame_count != frames + (size != 0))
+		return -1;
+
+	return size;
+}
+
+/// Frames stay within budget, decode on the device and converge on the keyboard state.
+static int test_color_frames(void)
+{
+	static struct sim device[1];
+	struct color_engine engine[1];
+	uint32_t lit = 0;
+	int size, frames;
+
+	memset(device, 0, sizeof(struct sim));
+	device->frames = 1;
+	color_engine_new(engine);
+
+	// Every key held, neighbours on different channels, more than one frame can carry.
+	for (uint8_t note = COLOR_FIRST_NOTE; note < COLOR_FIRST_NOTE + COLOR_PIXELS; ++note)
+		color_engine_note(engine, note, note % 16, 100, 1);
+
+	for (frames = 0; (size = test_frame_send(engine, device)) > 0; ++frames)
+		TEST_CHECK(size <= COLOR_FRAME_SIZE_MAX);
+
+	TEST_CHECK(size == 0 && frames > 1);
+
+	for (size_t i = 0; i < SIM_LEDS; ++i)
+		lit += device->lit[i];
+
+	TEST_CHECK(lit == SIM_LEDS);
+
+	for (uint8_t note = COLOR_FIRST_NOTE; note < COLOR_FIRST_NOTE + COLOR_PIXELS; ++note)
+		color_engine_note(engine, note, note % 16, 0, 0);
+
+	for (frames = 0; frames < 4 * COLOR_DECAY_STEPS && (size = test_frame_send(engine, device)) >= 0; ++frames)
+		TEST_CHECK(size <= COLOR_FRAME_SIZE_MAX);
+
+	TEST_CHECK(size >= 0 && color_engine_idle(engine));
+
+	for (size_t i = 0; i < SIM_LEDS; ++i)
+		TEST_CHECK(!device->lit[i]);
+
+	// A release of a key already let go does not flash it again.
+	color_engine_note(engine, 60, 0, 0, 0);
+	TEST_CHECK(test_frame_send(engine, device) == 0 && color_engine_idle(engine));
+
+	return 0;
+}
+
+/// Write `size` bytes to a new temporary file and store its path in `path`. Return 0, or -1 on error.
+static int test_file_write(char *path, const uint8_t *data, size_t size)
+{
+	int fd = mkstemp(path);
+
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, data, size) != (ssize_t) size) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/// A track without a tempo event plays at 120 BPM, whatever the track before it set.
+static int test_playlist_default_tempo(void)
+{
+	// 480 ticks per quarter, tempo 250000 us, one note of two quarters.
+	static const uint8_t fast[] = {
+		'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0x01, 0xE0,
+		'M', 'T', 'r', 'k', 0, 0, 0, 19,
+		0, 0xFF, MetaSetTempo, 3, 0x03, 0xD0, 0x90,
+		0, 0x90, 60, 100, 0x87, 0x40, 0x80, 60, 0,
+		0, 0xFF, MetaEndOfTrack, 0
+	};
+	// Same without the tempo event.
+	static const uint8_t plain[] = {
+		'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0x01, 0xE0,
+		'M', 'T', 'r', 'k', 0, 0, 0, 12,
+		0, 0x90, 60, 100, 0x87, 0x40, 0x80, 60, 0,
+		0, 0xFF, MetaEndOfTrack, 0
+	};
+	char first[] = "/tmp/test-fast-XXXXXX", second[] = "/tmp/test-plain-XXXXXX";
+	char *paths[3] = { first, second, second };
+	struct playlist playlist[1];
+	struct playlist_track *track;
+	struct midi_event event;
+	uint32_t us_per_tick[3];
+	size_t count = 0;
+
+	TEST_CHECK(!test_file_write(first, fast, sizeof(fast)) && !test_file_write(second, plain, sizeof(plain)));
+
+	playlist_new(playlist, paths, 3);
+	while ((track = playlist_next(playlist)) && count < 3) {
+		while (!midi_parser_eof(track->parser))
+			midi_parser_next(track->parser, track->file->stream, &event);
+
+		us_per_tick[count++] = track->parser->us_per_tick;
+	}
+
+	playlist_free(playlist);
+	unlink(first);
+	unlink(second);
+
+	TEST_CHECK(count == 3);
+	TEST_CHECK(us_per_tick[0] == 250000 / 480);
+	TEST_CHECK(us_per_tick[1] == 500000 / 480);
+	TEST_CHECK(us_per_tick[2] == 500000 / 480);
+	return 0;
+}
+
+/**
+A note never released and one held over thousands of others on the same
+key: a window lists only the notes overlapping it, wherever it is.
+*/
+static int test_roll_nested(void)
+{
+	static const uint64_t windows[] = { 0, 400000000, 1000000000, 1499000000, 1998000000 };
+	struct midi_stream_note *event;
+	struct roll_span spans[ROLL_LAYERS];
+	struct timeline timeline[1] = { 0 };
+	struct roll roll[1];
+	const struct roll_note *note;
+	uint64_t from, to, time, next = 0;
+	size_t count, visible, listed;
+
+	timeline->notes = (struct midi_stream_note *) malloc(sizeof(struct midi_stream_note) * (ROLL_TEST_NOTES * 2 + 3));
+	TEST_CHECK(timeline->notes);
+
+	// Channel 2 from 0 on, never released; channel 3 from 500 s to 1500 s; channel 1 every 10 ms for 5 ms.
+	event = timeline->notes;
+	*event++ = (struct midi_stream_note) { 0, 0x91, 60, 100 };
+	for (size_t i = 0; i < ROLL_TEST_NOTES; ++i) {
+		time = i * 10000;
+		if (time == 500000000)
+			*event++ = (struct midi_stream_note) { time, 0x92, 60, 100 };
+		if (time == 1500000000)
+			*event++ = (struct midi_stream_note) { time, 0x82, 60, 0 };
+
+		*event++ = (struct midi_stream_note) { time, 0x90, 60, 100 };
+		*event++ = (struct midi_stream_note) { time + 5000, 0x80, 60, 0 };
+	}
+
+	timeline->count = event - timeline->notes;
+	timeline->duration = event[-1].time;
+
+	if (!roll_new(roll, timeline)) {
+		timeline_free(timeline);
+		return 1;
+	}
+
+	for (size_t window = 0; window < sizeof(windows) / sizeof(windows[0]); ++window) {
+		from = windows[window];
+		to = from + 2000000;
+
+		visible = 0;
+		for (size_t i = 0; i < roll->count; ++i)
+			visible += roll->notes[i].start < to && roll->notes[i].end > from;
+
+		listed = 0;
+		count = roll_range(roll, 60, from, to, spans);
+		for (size_t span = 0; span < count; ++span) {
+			for (note = roll->notes + spans[span].first; note < roll->notes + spans[span].last; ++note) {
+				if (note->start >= to || note->end <= from)
+					break;
+
+				++listed;
+			}
+		}
+
+		note = roll_next(roll, 60, from + 1);
+		next = note ? note->start : 0;
+
+		if (listed != visible || next != from + 10000) {
+			printf("window at %llu s: %zu of %zu notes listed\n", (unsigned long long) from / 1000000, listed, visible);
+			break;
+		}
+	}
+
+	roll_free(roll);
+	timeline_free(timeline);
+
+	TEST_CHECK(listed == visible);
+	TEST_CHECK(next == from + 10000);
+	return 0;
+}
+
+/// Run `command` on `daemon` as if read from a client. Return -1 if it answered with an error, as daemon_client.
+static int test_daemon_command(struct daemon *daemon, const char *command, const char *argument)
+{
+	char line[DAEMON_COMMAND_MAX], reply[DAEMON_REPLY_MAX];
+
+	snprintf(line, sizeof(line), argument ? "%s %s" : "%s", command, argument);
+	daemon_command(daemon, line, link_clock(), reply, sizeof(reply));
+	return strncmp(reply, "error", 5) ? 0 : -1;
+}
+
+/// Commands as they reach the control thread, with the player's side called in between.
+static int test_daemon_run(struct daemon *daemon, const char *first, const char *second)
+{
+	struct daemon_entry *entry;
+	uint64_t position = 0;
+
+	TEST_CHECK(test_daemon_command(daemon, "seek", "10"));
+
+	// Before the player took the track, the seek waits for it.
+	TEST_CHECK(!test_daemon_command(daemon, "play", first));
+	TEST_CHECK(daemon->count == 1 && daemon->stats.misses == 1);
+	TEST_CHECK(!test_daemon_command(daemon, "seek", "10"));
+	entry = daemon_next(daemon);
+	TEST_CHECK(entry && !strcmp(entry->path, first) && daemon->current == entry);
+	TEST_CHECK(daemon_interrupt_take(daemon, &position) == DaemonSeek && position == 10000000);
+
+	TEST_CHECK(test_daemon_command(daemon, "seek", "-1"));
+	TEST_CHECK(test_daemon_command(daemon, "seek", "ten"));
+	TEST_CHECK(test_daemon_command(daemon, "seek", NULL));
+	TEST_CHECK(daemon_interrupted(daemon) == DaemonNone);
+
+	// A seek right after a play is for the new track, the play is not lost.
+	TEST_CHECK(!test_daemon_command(daemon, "play", second));
+	TEST_CHECK(!test_daemon_command(daemon, "seek", "1.5"));
+	TEST_CHECK(daemon_interrupt_take(daemon, &position) == DaemonPlay);
+
+	entry = daemon_next(daemon);
+	TEST_CHECK(entry && !strcmp(entry->path, second));
+	TEST_CHECK(daemon_interrupt_take(daemon, &position) == DaemonSeek && position == 1500000);
+
+	TEST_CHECK(!test_daemon_command(daemon, "seek", "0.5"));
+	TEST_CHECK(daemon_interrupt_take(daemon, &position) == DaemonSeek && position == 500000);
+
+	// A cached file is not decoded again, and the queue holds a reference to it.
+	TEST_CHECK(!test_daemon_command(daemon, "queue", first));
+	TEST_CHECK(daemon->count == 1 && daemon->stats.hits == 1 && daemon->stats.misses == 2);
+	TEST_CHECK(daemon->queue[daemon->head % DAEMON_QUEUE]->users == 1);
+
+	TEST_CHECK(!test_daemon_command(daemon, "stop", NULL));
+	TEST_CHECK(!daemon->count && daemon_interrupted(daemon) == DaemonStop);
+	TEST_CHECK(test_daemon_command(daemon, "play", "/nonexistent.mid"));
+	TEST_CHECK(test_daemon_command(daemon, "rewind", NULL));
+	TEST_CHECK(!test_daemon_command(daemon, "status", NULL));
+
+	TEST_CHECK(!test_daemon_command(daemon, "quit", NULL));
+	TEST_CHECK(!daemon_next(daemon));
+	for (entry = daemon->cache; entry < daemon->cache + DAEMON_CACHE; ++entry)
+		TEST_CHECK(!entry->users);
+
+	return 0;
+}
+
+/// The cache, queue and commands of the daemon, without its socket and threads.
+static int test_daemon_commands(void)
+{
+	static const uint8_t file[] = {
+		'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0x01, 0xE0,
+		'M', 'T', 'r', 'k', 0, 0, 0, 12,
+		0, 0x90, 60, 100, 0x87, 0x40, 0x80, 60, 0,
+		0, 0xFF, MetaEndOfTrack, 0
+	};
+	char first[] = "/tmp/test-daemon-XXXXXX", second[] = "/tmp/test-daemon-XXXXXX";
+	static struct daemon daemon[1];
+	int status;
+
+	TEST_CHECK(!test_file_write(first, file, sizeof(file)) && !test_file_write(second, file, sizeof(file)));
+
+	memset(daemon, 0, sizeof(struct daemon));
+	pthread_mutex_init(&daemon->lock, NULL);
+	pthread_cond_init(&daemon->wake, NULL);
+
+	status = test_daemon_run(daemon, first, second);
+
+	for (size_t i = 0; i < DAEMON_CACHE; ++i)
+		timeline_free(daemon->cache[i].timeline);
+
+	pthread_mutex_destroy(&daemon->lock);
+	pthread_cond_destroy(&daemon->wake);
+	unlink(first);
+	unlink(second);
+	return status;
+}
+
+struct test_writer_event
+{
+	uint32_t tick;
+	uint8_t status, data[2], size;
+};
+
+/// Read back `path` written by test_writer_round_trip and compare it with `events`.
+static int test_writer_read(const char *path, const struct test_writer_event *events, size_t count)
+{
+	struct midi_file file[1];
+	struct midi_parser parser[1];
+	struct midi_event event;
+	size_t read = 0;
+	FILE *midi;
+	int status = 0;
+
+	midi = fopen(path, "rb");
+	TEST_CHECK(midi);
+	if (!midi_file_load(file, midi)) {
+		fclose(midi);
+		return 1;
+	}
+
+	fclose(midi);
+	if (!midi_parser_new(parser, file->stream)) {
+		midi_file_free(file);
+		return 1;
+	}
+
+	while (!status && midi_parser_next(parser, file->stream, &event) && !midi_parser_eof(parser)) {
+		if (event.status == 0xFF) {
+			status = event.meta_type == MetaSetTempo && event.meta_data.tempo != TEST_WRITER_TEMPO;
+			continue;
+		}
+
+		status = read == count || event.status != events[read].status || event.size != events[read].size
+			|| memcmp(event.midi_data, events[read].data, event.size) || parser->timestamp != events[read].tick;
+		if (status)
+			printf("event %zu: status %02X, %u bytes at tick %u\n", read, event.status, event.size, parser->timestamp);
+
+		++read;
+	}
+
+	midi_file_free(file);
+	TEST_CHECK(!status);
+	TEST_CHECK(read == count && parser->ticks_per_quarter == TEST_WRITER_TICKS);
+	return 0;
+}
+
+/// Running status, messages of one data byte and deltas of every length come back through the parser.
+static int test_writer_round_trip(void)
+{
+	static const struct test_writer_event events[] = {
+		{ 0, 0x90, { 60, 100 }, 2 },
+		// Running status, zero delta.
+		{ 0, 0x90, { 64, 90 }, 2 },
+		{ 1, 0x80, { 60, 0 }, 2 },
+		{ 128, 0xC2, { 5 }, 1 },
+		{ 128 + 127, 0xC2, { 6 }, 1 },
+		{ 128 + 127 + 16384, 0xD2, { 40 }, 1 },
+		{ 128 + 127 + 16384 + 0x200000, 0xE1, { 0, 64 }, 2 },
+		// The longest delta a file can hold.
+		{ 128 + 127 + 16384 + 0x200000 + 0x0FFFFFFF, 0x90, { 64, 0 }, 2 },
+		{ 128 + 127 + 16384 + 0x200000 + 0x0FFFFFFF, 0x90, { 62, 1 }, 2 },
+	};
+	char path[] = "/tmp/test-writer-XXXXXX";
+	struct midi_writer writer[1];
+	uint32_t us_per_tick = TEST_WRITER_TEMPO / TEST_WRITER_TICKS;
+	int fd, status;
+
+	fd = mkstemp(path);
+	TEST_CHECK(fd >= 0);
+	close(fd);
+
+	if (!midi_writer_new(writer, path, TEST_WRITER_TICKS, TEST_WRITER_TEMPO)) {
+		unlink(path);
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); ++i)
+		midi_writer_event(writer, (uint64_t) events[i].tick * us_per_tick, events[i].status, events[i].data, events[i].size);
+
+	status = midi_writer_close(writer) || test_writer_read(path, events, sizeof(events) / sizeof(events[0]));
+	unlink(path);
+	return status;
+}
+
+
+/**
+Both readers agree on a format 1 file: notes of two tracks interleaved,
+running status over one and two data bytes, and a tempo change in the
+first track timing the notes of the second.
+*/
+static int test_stream_parser(void)
+{
+	// 100 ticks per quarter, so 5000 us per tick and 2500 once the tempo doubles at tick 200.
+	static const uint8_t file[] = {
+		'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0, 100,
+		'M', 'T', 'r', 'k', 0, 0, 0, 21,
+		0, 0x90, 60, 100,
+		0x81, 0x48, 0xFF, MetaSetTempo, 3, 0x03, 0xD0, 0x90,
+		0x81, 0x00, 0x80, 60, 0,
+		0, 0xFF, MetaEndOfTrack, 0,
+		'M', 'T', 'r', 'k', 0, 0, 0, 23,
+		50, 0x91, 64, 90,
+		100, 67, 80,
+		100, 64, 0,
+		0, 0xC1, 5,
+		20, 6,
+		30, 0x81, 67, 0,
+		0, 0xFF, MetaEndOfTrack, 0
+	};
+	static const struct midi_stream_note expected[] = {
+		{ 0, 0x90, 60, 100 },
+		{ 50 * 5000, 0x91, 64, 90 },
+		{ 150 * 5000, 0x91, 67, 80 },
+		{ 200 * 5000 + 50 * 2500, 0x91, 64, 0 },
+		{ 200 * 5000 + 100 * 2500, 0x81, 67, 0 },
+		{ 200 * 5000 + 128 * 2500, 0x80, 60, 0 },
+	};
+	char path[] = "/tmp/test-stream-XXXXXX";
+	struct midi_stream stream[1];
+	struct midi_stream_note note;
+	struct midi_file midi[1];
+	struct midi_parser parser[1];
+	struct midi_event event;
+	size_t parsed = 0, streamed = 0;
+	uint64_t time = 0;
+	int status = 0;
+	FILE *input;
+
+	TEST_CHECK(!test_file_write(path, file, sizeof(file)));
+
+	// Timed the way `midi_play` does.
+	input = fopen(path, "rb");
+	TEST_CHECK(input && midi_file_load(midi, input) && midi_parser_new(parser, midi->stream));
+	fclose(input);
+
+	parser->us_per_tick = 60E6 / 120 / parser->ticks_per_quarter;
+	while (!midi_parser_eof(parser)) {
+		midi_parser_next(parser, midi->stream, &event);
+
+		if (MIDI_EVENT_TYPE(&event) == EventNoteOn || MIDI_EVENT_TYPE(&event) == EventNoteOff) {
+			status |= parsed == sizeof(expected) / sizeof(expected[0]) || time != expected[parsed].time
+				|| event.status != expected[parsed].status || event.midi_data[0] != expected[parsed].note
+				|| event.midi_data[1] != expected[parsed].velocity;
+			++parsed;
+		}
+
+		if (parser->dtime == (uint32_t) ~0)
+			break;
+
+		time += MIDI_DELAY(parser);
+	}
+
+	midi_file_free(midi);
+
+	if (!midi_stream_open(stream, path, MIDI_STREAM_MEMORY)) {
+		unlink(path);
+		return 1;
+	}
+
+	while (midi_stream_next(stream, &note)) {
+		status |= streamed == sizeof(expected) / sizeof(expected[0]) || note.time != expected[streamed].time
+			|| note.status != expected[streamed].status || note.note != expected[streamed].note
+			|| note.velocity != expected[streamed].velocity;
+		++streamed;
+	}
+
+	midi_stream_free(stream);
+	unlink(path);
+
+	TEST_CHECK(!status);
+	TEST_CHECK(parsed == sizeof(expected) / sizeof(expected[0]) && streamed == parsed);
+	return 0;
+}
+
+
+/// The clock moves without notes, and a finished segment shows no held key.
+static int test_shm_finish(void)
+{
+	struct keyboard_shm *writer, *reader;
+	struct keyboard_state state;
+
+	writer = keyboard_shm_create(SHM_TEST_NAME);
+	reader = writer ? keyboard_shm_open(SHM_TEST_NAME) : NULL;
+	shm_unlink(SHM_TEST_NAME);
+	TEST_CHECK(reader);
+
+	keyboard_shm_note(writer, 60, 100, 1, 1000);
+	keyboard_shm_clock(writer, 2000);
+	keyboard_shm_read(reader, &state);
+	TEST_CHECK(state.clock == 2000 && state.events == 1 && state.notes[60] && !state.finished);
+
+	keyboard_shm_finish(writer);
+	keyboard_shm_read(reader, &state);
+	TEST_CHECK(state.finished && state.events == 2 && !state.notes[60] && !state.velocity[60]);
+
+	keyboard_shm_close(reader);
+	keyboard_shm_close(writer);
+	return 0;
+}
+
+
+static const struct
+{
+	const char *name;
+	int (*run)(void);
+}
+tests[] = {
+	{ "link_release_order", test_link_release_order },
+	{ "color_frames", test_color_frames },
+	{ "playlist_default_tempo", test_playlist_default_tempo },
+	{ "roll_nested", test_roll_nested },
+	{ "daemon_commands", test_daemon_commands },
+	{ "writer_round_trip", test_writer_round_trip },
+	{ "stream_parser", test_stream_parser },
+	{ "shm_finish", test_shm_finish },
+};
+
+/// Run every unit test. Return the number that failed.
+static int test_run(void)
+{
+	int failed = 0;
+
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		if (tests[i].run()) {
+			printf("FAIL %s\n", tests[i].name);
+			++failed;
+		} else {
+			printf("ok   %s\n", tests[i].name);
+		}
+	}
+
+	return failed;
+}
+
+
+/// Print the keyboard published in the segment `name` whenever it changes, for `seconds` or until the player exits.
+static int shm_read(const char *name, double seconds)
+{
+	struct keyboard_shm *shm = keyboard_shm_open(name);
+	struct keyboard_state state;
+	uint64_t events = ~0ULL, end = test_clock() + seconds * 1e6;
+
+	if (!shm)
+		return 1;
+
+	while (test_clock() < end) {
+		keyboard_shm_read(shm, &state);
+		if (state.events != events) {
+			events = state.events;
+			for (size_t i = 21; i <= 108; ++i)
+				putchar(state.notes[i] ? 'H' : '.');
+
+			printf(" %llu%s\n", (unsigned long long) events, state.finished ? " finished" : "");
+		}
+
+		if (state.finished)
+			break;
+
+		usleep(10000);
+	}
+
+	keyboard_shm_close(shm);
+	return 0;
+}
+
+struct shm_writer
+{
+	struct keyboard_shm *shm;
+	uint32_t rate;
+	_Atomic uint8_t done;
+};
+
+/// Publish note events at `rate` per second, or flat out for 0, until told to stop.
+static void *shm_write(void *argument)
+{
+	struct shm_writer *self = (struct shm_writer *) argument;
+	uint64_t start = test_clock(), events = 0;
+
+	while (!atomic_load_explicit(&self->done, memory_order_relaxed)) {
+		// The clock field tracks the event count, so a torn snapshot shows.
+		keyboard_shm_note(self->shm, 21 + events % 88, 100, events / 88 % 2 == 0, events + 1);
+		++events;
+
+		if (self->rate) {
+			while (!atomic_load_explicit(&self->done, memory_order_relaxed)
+			&& test_clock() < start + events * 1000000 / self->rate)
+				usleep(100);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+Read snapshots flat out for `seconds` while a writer publishes `rate` events per second.
+Return 1 if any snapshot was torn.
+*/
+static int shm_bench(uint32_t rate, double seconds)
+{
+	struct shm_writer writer = { .rate = rate };
+	struct keyboard_shm *reader;
+	struct keyboard_state state;
+	uint64_t reads = 0, retries = 0, torn = 0, start, elapsed;
+	pthread_t thread;
+
+	writer.shm = keyboard_shm_create(SHM_BENCH_NAME);
+	reader = writer.shm ? keyboard_shm_open(SHM_BENCH_NAME) : NULL;
+	if (!reader || pthread_create(&thread, NULL, shm_write, &writer) != 0)
+		return 1;
+
+	start = test_clock();
+	do {
+		for (int i = 0; i < 1024; ++i, ++reads) {
+			retries += keyboard_shm_read(reader, &state);
+			torn += state.clock != state.events;
+		}
+
+		elapsed = test_clock() - start;
+	} while (elapsed < seconds * 1e6);
+
+	atomic_store_explicit(&writer.done, 1, memory_order_relaxed);
+	pthread_join(thread, NULL);
+
+	printf("shm: writer %u events/s, %llu events; %llu reads at %.1f ns, %llu retries, %llu torn\n",
+		rate, (unsigned long long) state.events, (unsigned long long) reads, elapsed * 1e3 / reads,
+		(unsigned long long) retries, (unsigned long long) torn);
+
+	keyboard_shm_close(reader);
+	keyboard_shm_close(writer.shm);
+	shm_unlink(SHM_BENCH_NAME);
+	return torn ? 1 : 0;
+}
+
+
+/**
+Time color_engine_tick and color_engine_encode over `frames` frames of
+a dense keyboard: every frame a quarter of the keys are struck or
+released, on all channels, and the frames are cut to `budget` bytes.
+*/
+static int color_bench(uint32_t frames, uint32_t budget)
+{
+	static struct color_engine engine[1];
+	uint8_t frame[COLOR_FRAME_SIZE_MAX];
+	uint64_t start, tick, encode, tick_total = 0, encode_total = 0, max = 0, bytes = 0;
+	uint32_t random = 1;
+
+	if (budget > COLOR_FRAME_SIZE_MAX)
+		return 1;
+
+	color_engine_new(engine);
+
+	for (uint32_t i = 0; i < frames; ++i) {
+		for (uint8_t note = COLOR_FIRST_NOTE; note < COLOR_FIRST_NOTE + COLOR_PIXELS; ++note) {
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+
+			if (random % 4 == 0)
+				color_engine_note(engine, note, random >> 8 & 0x0F, random >> 16 & 0x7F, random >> 24 & 1);
+		}
+
+		start = color_clock_ns();
+		color_engine_tick(engine);
+		tick = color_clock_ns() - start;
+
+		bytes += color_engine_encode(engine, frame, budget);
+		encode = color_clock_ns() - start - tick;
+
+		tick_total += tick;
+		encode_total += encode;
+		max = MIDI_MAX(max, tick + encode);
+	}
+
+	printf("color: %u frames at %u bytes, tick %.0f ns, encode %.0f ns, %.0f ns per frame (max %llu, %.3f%% of a frame)\n",
+		frames, budget, (double) tick_total / frames, (double) encode_total / frames,
+		(double) (tick_total + encode_total) / frames, (unsigned long long) max,
+		(tick_total + encode_total) / 1e7 * COLOR_FRAME_RATE / frames);
+	printf("color: %.1f bytes per frame, %.1f runs, %llu deferred\n",
+		(double) bytes / frames, (double) engine->runs / frames, (unsigned long long) engine->deferred);
+	return 0;
+}
+
+
+/// The loop the raster replaces: `notes[128]` replayed event by event and copied out every frame.
+static uint8_t *raster_bytes_new(const struct timeline *timeline, uint32_t fps, size_t count)
+{
+	const struct midi_stream_note *note = timeline->notes, *end = timeline->notes + timeline->count;
+	uint8_t held[128] = { 0 }, *frames, *frame;
+	uint64_t frame_end;
+
+	frames = (uint8_t *) malloc(count * 128);
+	if (!frames)
+		return NULL;
+
+	for (size_t index = 0; index < count; ++index) {
+		frame = frames + index * 128;
+		frame_end = ((index + 1) * 1000000 + fps - 1) / fps;
+		memcpy(frame, held, 128);
+
+		for (; note < end && note->time < frame_end; ++note) {
+			if (timeline_note_on(note))
+				held[note->note] = frame[note->note] = 1;
+			else
+				held[note->note] = 0;
+		}
+	}
+
+	return frames;
+}
+
+static void raster_bytes_stats(const uint8_t *frames, size_t count, struct raster_stats *stats)
+{
+	uint64_t polyphony = 0;
+	uint32_t keys, onsets;
+
+	memset(stats, 0, sizeof(struct raster_stats));
+
+	for (size_t index = 0; index < count; ++index) {
+		keys = onsets = 0;
+
+		for (size_t key = 0; key < 128; ++key) {
+			keys += frames[index * 128 + key];
+			onsets += frames[index * 128 + key] && (!index || !frames[(index - 1) * 128 + key]);
+		}
+
+		polyphony += keys;
+		stats->onsets += onsets;
+		stats->max_polyphony = MIDI_MAX(stats->max_polyphony, keys);
+		stats->max_onsets = MIDI_MAX(stats->max_onsets, onsets);
+	}
+
+	stats->mean_polyphony = count ? (double) polyphony / count : 0;
+}
+
+static uint8_t raster_stats_equal(const struct raster_stats *a, const struct raster_stats *b)
+{
+	return a->onsets == b->onsets && a->max_polyphony == b->max_polyphony
+		&& a->max_onsets == b->max_onsets && a->mean_polyphony == b->mean_polyphony;
+}
+
+/**
+Rasterize `path` at `fps` with every kernel the CPU runs and with the
+byte-per-key loop, check they agree, and print the best of a few runs.
+*/
+static int raster_bench(const char *path, uint32_t fps)
+{
+	const struct raster_kernel *kernel;
+	struct timeline timeline[1];
+	struct raster raster[1];
+	struct raster_stats stats[1], expected[1];
+	uint64_t start, build, compute, best_build, best_compute;
+	uint8_t *bytes = NULL;
+	size_t count = 0;
+	int status = 0;
+
+	if (!timeline_load(timeline, path))
+		return 1;
+
+	best_build = best_compute = ~0ULL;
+	for (int run = 0; run < RASTER_BENCH_RUNS; ++run) {
+		free(bytes);
+		count = timeline->duration * fps / 1000000 + 1;
+
+		start = test_clock();
+		bytes = raster_bytes_new(timeline, fps, count);
+		build = test_clock() - start;
+		if (!bytes)
+			return 1;
+
+		raster_bytes_stats(bytes, count, expected);
+		compute = test_clock() - start - build;
+
+		best_build = MIDI_MIN(best_build, build);
+		best_compute = MIDI_MIN(best_compute, compute);
+	}
+
+	printf("raster: %s, %zu notes, %zu frames at %u fps\n", path, timeline->count, count, fps);
+	printf("  %-8s build %9.3f ms, stats %9.3f ms\n", "bytes", best_build / 1000.0, best_compute / 1000.0);
+
+	for (kernel = raster_kernels; kernel <= raster_kernel_select(); ++kernel) {
+		best_build = best_compute = ~0ULL;
+		for (int run = 0; run < RASTER_BENCH_RUNS; ++run) {
+			start = test_clock();
+			if (!raster_new(raster, timeline, fps, kernel))
+				return 1;
+
+			build = test_clock() - start;
+			raster_stats_compute(raster, stats);
+			compute = test_clock() - start - build;
+
+			best_build = MIDI_MIN(best_build, build);
+			best_compute = MIDI_MIN(best_compute, compute);
+
+			if (run < RASTER_BENCH_RUNS - 1)
+				raster_free(raster);
+		}
+
+		printf("  %-8s build %9.3f ms, stats %9.3f ms\n", kernel->name, best_build / 1000.0, best_compute / 1000.0);
+
+		// Same keys in every frame, and the same statistics.
+		for (size_t index = 0; index < raster->count && !status; ++index) {
+			for (uint32_t key = 0; key < 128; ++key) {
+				if ((raster->frames[index].word[key >> 6] >> (key & 63) & 1) != bytes[index * 128 + key]) {
+					printf("  %s differs at frame %zu, key %u\n", kernel->name, index, key);
+					status = 1;
+					break;
+				}
+			}
+		}
+
+		if (!raster_stats_equal(stats, expected)) {
+			printf("  %s statistics differ\n", kernel->name);
+			status = 1;
+		}
+
+		raster_free(raster);
+	}
+
+	free(bytes);
+	timeline_free(timeline);
+	return status;
+}
+
+
+/**
+Usage:
+	test					run the unit tests
+	test shm-read name [seconds]		print the keyboard published by `main -s name`
+	test shm-bench [events/s] [seconds]	reader benchmark against a writer thread, 0 for flat out
+	test color-bench [frames] [bytes]	colour engine tick and encode on a dense keyboard, 32 byte frames by default
+	test raster-bench midi [fps]		bitset raster against the byte-per-key loop, 240 fps by default
+	test sim [notes|frames] [show_us]	device simulator; run `main -d <printed path> piece.mid` against it
+*/
+int main(int argc, char **argv)
+{
+	if (argc == 1)
+		return test_run() ? 1 : 0;
+
+	if (argc > 1 && !strcmp(argv[1], "sim"))
+		return sim_run(argc > 2 && !strcmp(argv[2], "frames"), argc > 3 ? atoi(argv[3]) : SIM_SHOW);
+
+	if (argc > 2 && !strcmp(argv[1], "shm-read"))
+		return shm_read(argv[2], argc > 3 ? atof(argv[3]) : 10);
+
+	if (argc > 1 && !strcmp(argv[1], "shm-bench"))
+		return shm_bench(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atof(argv[3]) : 1);
+
+	if (argc > 1 && !strcmp(argv[1], "color-bench"))
+		return color_bench(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : COLOR_BENCH_BUDGET);
+
+	if (argc > 2 && !strcmp(argv[1], "raster-bench"))
+		return raster_bench(argv[2], argc > 3 ? atoi(argv[3]) : 240);
+
+	fprintf(stderr, "Usage: %s [shm-read name [seconds] | shm-bench [events/s] [seconds]\n", argv[0]);
+	fprintf(stderr, "       | color-bench [frames] [bytes] | raster-bench midi [fps] | sim [notes|frames] [show_us]]\n");
+	return 2;
+}